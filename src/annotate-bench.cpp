@@ -0,0 +1,424 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Replays strokes through annotate's drawing code offscreen and reports
+ * the cost per input event, the texture upload traffic per frame and
+ * the memory used. Strokes come from a file saved by the persist option
+ * or are generated. Uploads go to a surfaceless EGL context when one
+ * can be created, otherwise only the upload sizes are counted.
+ *
+ * Usage: annotate-bench [width height [strokes-file]]
+ */
+
+#include <set>
+#include <cmath>
+#include <string>
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/resource.h>
+
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+#include "annotate-canvas.hpp"
+#include "annotate-stroke.hpp"
+#include "annotate-filter.hpp"
+#include "annotate-store.hpp"
+#include "annotate-history.hpp"
+
+using namespace annotate;
+using bench_clock = std::chrono::steady_clock;
+
+/* Input events at 1 kHz, like a tablet, drawn at 60 Hz */
+static constexpr int EVENTS_PER_FRAME = 16;
+/* The default decimation option */
+static constexpr float DECIMATION = 0.5;
+
+#ifdef HAVE_EGL
+static bool make_context()
+{
+    auto get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+        eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (!get_platform_display)
+    {
+        return false;
+    }
+
+    EGLDisplay display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+        EGL_DEFAULT_DISPLAY, nullptr);
+    if ((display == EGL_NO_DISPLAY) || !eglInitialize(display, nullptr, nullptr) ||
+        !eglBindAPI(EGL_OPENGL_ES_API))
+    {
+        return false;
+    }
+
+    const EGLint attribs[] = {EGL_CONTEXT_CLIENT_VERSION, 2, EGL_NONE};
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR,
+        EGL_NO_CONTEXT, attribs);
+
+    return (context != EGL_NO_CONTEXT) &&
+           eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+#else
+static bool make_context()
+{
+    return false;
+}
+
+#endif
+
+static bool supports_unpack_row_length()
+{
+    std::string version    = (const char*)glGetString(GL_VERSION);
+    std::string extensions = (const char*)glGetString(GL_EXTENSIONS);
+
+    return version.find("OpenGL ES 3") != std::string::npos ||
+           extensions.find("GL_EXT_unpack_subimage") != std::string::npos;
+}
+
+/* Wandering strokes with a few shapes and erase strokes in between */
+static std::vector<stroke_t> make_strokes(int width, int height, std::mt19937& rng)
+{
+    std::uniform_real_distribution<float> unit(0, 1);
+    std::vector<stroke_t> strokes;
+
+    for (int i = 0; i < 200; i++)
+    {
+        stroke_t stroke;
+        stroke.r = unit(rng);
+        stroke.g = unit(rng);
+        stroke.b = unit(rng);
+        stroke.a = 1;
+        stroke.width = 2 + unit(rng) * 8;
+
+        point_t p = {unit(rng) * width, unit(rng) * height};
+        point_t q = {unit(rng) * width, unit(rng) * height};
+        if (i % 10 == 9)
+        {
+            stroke.method = (annotate_draw_method)(ANNOTATE_METHOD_LINE + i / 10 % 3);
+            stroke.points = {p, q};
+            strokes.push_back(std::move(stroke));
+            continue;
+        }
+
+        if (i % 20 == 4)
+        {
+            stroke.method = ANNOTATE_METHOD_ERASE;
+            stroke.width  = 20;
+        }
+
+        bool pressure = i % 2;
+        float angle   = unit(rng) * 6.28f;
+        int count     = 200 + rng() % 1800;
+        for (int j = 0; j < count; j++)
+        {
+            angle += (unit(rng) - 0.5f) * 0.2f;
+            p.x = std::clamp(p.x + std::cos(angle) * 1.5f, 0.0f, (float)width);
+            p.y = std::clamp(p.y + std::sin(angle) * 1.5f, 0.0f, (float)height);
+            stroke.points.push_back(p);
+            if (pressure)
+            {
+                stroke.widths.push_back(stroke.width * (0.3f + 0.7f * unit(rng)));
+            }
+        }
+
+        strokes.push_back(std::move(stroke));
+    }
+
+    return strokes;
+}
+
+struct upload_bytes_t
+{
+    size_t row_length = 0, full_rows = 0;
+};
+
+/*
+ * What canvas_t::upload() transfers, with and without
+ * GL_UNPACK_ROW_LENGTH. uploaded holds the tiles that have a texture.
+ */
+static upload_bytes_t pending_upload(canvas_t& canvas, std::set<std::pair<int, int>>& uploaded)
+{
+    upload_bytes_t bytes;
+    canvas.for_each_tile([&] (tile_t& tile, rect_t box)
+    {
+        if (tile.dirty.empty())
+        {
+            return;
+        }
+
+        if (uploaded.insert({box.x, box.y}).second)
+        {
+            bytes.row_length += TILE_SIZE * TILE_SIZE * 4;
+            bytes.full_rows  += TILE_SIZE * TILE_SIZE * 4;
+        } else
+        {
+            bytes.row_length += (size_t)tile.dirty.width * tile.dirty.height * 4;
+            bytes.full_rows  += (size_t)TILE_SIZE * tile.dirty.height * 4;
+        }
+    });
+
+    return bytes;
+}
+
+static size_t count_tiles(canvas_t& canvas, std::set<std::pair<int, int>>& uploaded)
+{
+    size_t tiles = 0;
+    uploaded.clear();
+    canvas.for_each_tile([&] (tile_t& tile, rect_t box)
+    {
+        tiles++;
+        if (tile.dirty.empty())
+        {
+            uploaded.insert({box.x, box.y});
+        }
+    });
+
+    return tiles;
+}
+
+/*
+ * A rebuild rasterizes a copy of the strokes on the worker. When they
+ * are cleared before it is done, the result must be dropped, or the
+ * cleared strokes come back in the canvas. Undoing the clear restores
+ * the same strokes, but the canvas may have been drawn on meanwhile,
+ * so that must not make the result current again either.
+ */
+static int check_stale_rebuild(const std::vector<stroke_t>& recorded,
+    int width, int height)
+{
+    int failures = 0;
+    std::vector<stroke_t> strokes;
+    history_t history;
+    history.set_budget(64 << 20);
+    for (auto& stroke : recorded)
+    {
+        strokes.push_back(stroke);
+        history.record_stroke();
+    }
+
+    auto rebuild = [&] (uint64_t& generation)
+    {
+        generation = history.generation();
+        auto copy  = strokes;
+        canvas_t canvas;
+        canvas.resize(width, height);
+        for (auto& stroke : copy)
+        {
+            paint_stroke(canvas, stroke);
+        }
+
+        return canvas;
+    };
+
+    uint64_t generation;
+    auto stale = rebuild(generation);
+    history.record_clear(strokes);
+    if (generation == history.generation())
+    {
+        fprintf(stderr, "rebuild pending during a clear is not dropped\n");
+        failures++;
+    }
+
+    auto redone = rebuild(generation);
+    if (!strokes.empty() || !redone.empty())
+    {
+        fprintf(stderr, "rebuild after a clear is not empty\n");
+        failures++;
+    }
+
+    history.undo(strokes);
+    if (generation == history.generation())
+    {
+        fprintf(stderr, "rebuild pending during an undo is not dropped\n");
+        failures++;
+    }
+
+    return failures;
+}
+
+int main(int argc, char *argv[])
+{
+    int width  = argc > 2 ? atoi(argv[1]) : 3840;
+    int height = argc > 2 ? atoi(argv[2]) : 2160;
+
+    std::vector<stroke_t> strokes;
+    if (argc > 3)
+    {
+        uint32_t w, h;
+        if (!load_strokes(argv[3], strokes, w, h))
+        {
+            fprintf(stderr, "Could not load strokes from %s\n", argv[3]);
+            return EXIT_FAILURE;
+        }
+
+        /* Replay at the recorded size, as restore would */
+        width  = w;
+        height = h;
+    } else
+    {
+        std::mt19937 rng(1);
+        strokes = make_strokes(width, height, rng);
+    }
+
+    int failures = check_stale_rebuild(strokes, width, height);
+
+    bool gl = make_context();
+    canvas_t canvas;
+    canvas.unpack_row_length = gl ? supports_unpack_row_length() : true;
+    canvas.resize(width, height);
+
+    std::set<std::pair<int, int>> uploaded;
+    bench_clock::duration paint_time{}, upload_time{}, tessellate_time{};
+    bench_clock::duration finish_time{}, shape_time{};
+    size_t events = 0, frames = 0, shapes = 0, points_kept = 0;
+    size_t peak_tiles = 0;
+    upload_bytes_t total_upload, peak_upload;
+
+    auto upload_frame = [&] ()
+    {
+        auto bytes = pending_upload(canvas, uploaded);
+        total_upload.row_length += bytes.row_length;
+        total_upload.full_rows  += bytes.full_rows;
+        peak_upload.row_length   = std::max(peak_upload.row_length, bytes.row_length);
+        peak_upload.full_rows    = std::max(peak_upload.full_rows, bytes.full_rows);
+        frames++;
+
+        auto start = bench_clock::now();
+        if (gl)
+        {
+            canvas.upload();
+            glFinish();
+        } else
+        {
+            canvas.for_each_tile([] (tile_t& tile, rect_t) { tile.dirty = {0, 0, 0, 0}; });
+        }
+
+        upload_time += bench_clock::now() - start;
+    };
+
+    for (auto& recorded : strokes)
+    {
+        /* Shapes are previewed on the GPU and painted once, when committed */
+        if ((recorded.method != ANNOTATE_METHOD_DRAW) &&
+            (recorded.method != ANNOTATE_METHOD_ERASE))
+        {
+            auto start = bench_clock::now();
+            paint_stroke(canvas, recorded);
+            tessellate_stroke(recorded);
+            shape_time += bench_clock::now() - start;
+            upload_frame();
+            shapes++;
+            continue;
+        }
+
+        /* Freehand strokes grow by one point per event, like cairo_draw */
+        stroke_t stroke = recorded;
+        stroke.points.clear();
+        stroke.widths.clear();
+        stroke.smooth = false;
+        for (size_t i = 0; i < recorded.points.size(); i += EVENTS_PER_FRAME)
+        {
+            size_t first = stroke.points.size();
+            size_t last  = std::min(i + EVENTS_PER_FRAME, recorded.points.size());
+            stroke.points.insert(stroke.points.end(),
+                recorded.points.begin() + i, recorded.points.begin() + last);
+            if (!recorded.widths.empty())
+            {
+                stroke.widths.insert(stroke.widths.end(),
+                    recorded.widths.begin() + i, recorded.widths.begin() + last);
+            }
+
+            auto start = bench_clock::now();
+            paint_stroke(canvas, stroke, first);
+            paint_time += bench_clock::now() - start;
+
+            start = bench_clock::now();
+            tessellate_stroke(stroke);
+            tessellate_time += bench_clock::now() - start;
+
+            upload_frame();
+            events += last - i;
+        }
+
+        auto start = bench_clock::now();
+        auto kept  = decimate_indices(stroke.points, DECIMATION);
+        if (stroke.method == ANNOTATE_METHOD_ERASE)
+        {
+            canvas.release_empty(stroke_bounds(stroke));
+        }
+
+        finish_time += bench_clock::now() - start;
+        points_kept += kept.size();
+        peak_tiles   = std::max(peak_tiles, count_tiles(canvas, uploaded));
+    }
+
+    auto us = [] (bench_clock::duration d, size_t n)
+    {
+        return n ? std::chrono::duration<double, std::micro>(d).count() / n : 0.0;
+    };
+
+    size_t tiles = count_tiles(canvas, uploaded);
+    auto start   = bench_clock::now();
+    canvas.pack();
+    auto pack_time = bench_clock::now() - start;
+    start = bench_clock::now();
+    canvas.unpack();
+    auto unpack_time = bench_clock::now() - start;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("%dx%d, %zu strokes, %zu events, %zu frames, uploads %s\n",
+        width, height, strokes.size(), events, frames,
+        gl ? (const char*)glGetString(GL_RENDERER) : "counted only, no EGL context");
+    printf("paint      %8.3f us/event\n", us(paint_time, events));
+    printf("upload     %8.3f us/event\n", us(upload_time, events));
+    printf("tessellate %8.3f us/event\n", us(tessellate_time, events));
+    printf("finish     %8.3f us/event, %zu of %zu points kept\n",
+        us(finish_time, events), points_kept, events);
+    printf("shapes     %8.3f us/commit\n", us(shape_time, shapes));
+    printf("upload     %8.1f KiB/frame mean, %8.1f KiB peak (row length)\n",
+        total_upload.row_length / 1024.0 / std::max<size_t>(frames, 1),
+        peak_upload.row_length / 1024.0);
+    printf("upload     %8.1f KiB/frame mean, %8.1f KiB peak (full rows)\n",
+        total_upload.full_rows / 1024.0 / std::max<size_t>(frames, 1),
+        peak_upload.full_rows / 1024.0);
+    printf("tiles      %zu now, %zu peak of %d, %.1f MiB peak\n", tiles, peak_tiles,
+        ((width + TILE_SIZE - 1) / TILE_SIZE) * ((height + TILE_SIZE - 1) / TILE_SIZE),
+        peak_tiles * TILE_SIZE * TILE_SIZE * 4 / 1048576.0);
+    printf("pack       %8.3f ms, unpack %.3f ms\n",
+        std::chrono::duration<double, std::milli>(pack_time).count(),
+        std::chrono::duration<double, std::milli>(unpack_time).count());
+    printf("peak rss   %ld KiB\n", usage.ru_maxrss);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
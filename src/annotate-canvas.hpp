@@ -0,0 +1,546 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+/*
+ * Sparse tiled drawing canvas used by annotate. Tiles are allocated the
+ * first time something is drawn on them and freed when the canvas is
+ * cleared, so memory follows the amount of ink rather than the output
+ * size. Each tile has its own texture, uploaded independently.
+ *
+ * Tiles of a canvas that is not shown can be packed: their pixels are
+ * run-length encoded into CPU memory and their surfaces and textures
+ * freed. Sparse ink compresses very well this way.
+ *
+ * This only depends on cairo and GLES, so it can be used without a
+ * running compositor. Functions touching textures must be called with
+ * a GL context current.
+ */
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <cairo.h>
+#include <GLES3/gl3.h>
+
+#ifndef GL_UNPACK_ROW_LENGTH_EXT
+#define GL_UNPACK_ROW_LENGTH_EXT 0x0CF2
+#endif
+
+namespace annotate
+{
+struct rect_t
+{
+    int x, y, width, height;
+
+    bool empty() const
+    {
+        return width <= 0 || height <= 0;
+    }
+};
+
+inline rect_t rect_union(const rect_t& a, const rect_t& b)
+{
+    if (a.empty())
+    {
+        return b;
+    }
+
+    if (b.empty())
+    {
+        return a;
+    }
+
+    int x1 = std::min(a.x, b.x);
+    int y1 = std::min(a.y, b.y);
+    int x2 = std::max(a.x + a.width, b.x + b.width);
+    int y2 = std::max(a.y + a.height, b.y + b.height);
+
+    return {x1, y1, x2 - x1, y2 - y1};
+}
+
+inline rect_t rect_intersection(const rect_t& a, const rect_t& b)
+{
+    int x1 = std::max(a.x, b.x);
+    int y1 = std::max(a.y, b.y);
+    int x2 = std::min(a.x + a.width, b.x + b.width);
+    int y2 = std::min(a.y + a.height, b.y + b.height);
+
+    return {x1, y1, std::max(x2 - x1, 0), std::max(y2 - y1, 0)};
+}
+
+static constexpr int TILE_SIZE = 256;
+
+/*
+ * Each token starts with a header word. With the high bit set, the
+ * low bits are a run length and one pixel value follows, otherwise
+ * they are the number of literal pixels that follow.
+ */
+static constexpr uint32_t RLE_RUN = 1u << 31;
+
+inline void rle_encode(const uint32_t *pixels, size_t count, std::vector<uint32_t>& out)
+{
+    size_t i = 0, literal = 0;
+    while (i < count)
+    {
+        size_t run = 1;
+        while ((i + run < count) && (pixels[i + run] == pixels[i]))
+        {
+            run++;
+        }
+
+        if (run < 3)
+        {
+            literal += run;
+            i += run;
+            continue;
+        }
+
+        if (literal)
+        {
+            out.push_back(literal);
+            out.insert(out.end(), pixels + i - literal, pixels + i);
+            literal = 0;
+        }
+
+        out.push_back(RLE_RUN | run);
+        out.push_back(pixels[i]);
+        i += run;
+    }
+
+    if (literal)
+    {
+        out.push_back(literal);
+        out.insert(out.end(), pixels + count - literal, pixels + count);
+    }
+}
+
+/* Returns the position after the decoded pixels */
+inline const uint32_t *rle_decode(const uint32_t *in, uint32_t *pixels, size_t count)
+{
+    size_t i = 0;
+    while (i < count)
+    {
+        uint32_t header = *in++;
+        size_t n = std::min((size_t)(header & ~RLE_RUN), count - i);
+        if (header & RLE_RUN)
+        {
+            std::fill(pixels + i, pixels + i + n, *in++);
+        } else
+        {
+            std::copy(in, in + n, pixels + i);
+            in += n;
+        }
+
+        i += n;
+    }
+
+    return in;
+}
+
+struct tile_t
+{
+    cairo_surface_t *surface = nullptr;
+    cairo_t *cr = nullptr;
+    /* 0 until the tile is first uploaded */
+    GLuint tex = 0;
+    /* Tile-local area drawn since the last upload */
+    rect_t dirty = {0, 0, 0, 0};
+
+    tile_t()
+    {
+        surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+            TILE_SIZE, TILE_SIZE);
+        cr = cairo_create(surface);
+    }
+
+    ~tile_t()
+    {
+        cairo_destroy(cr);
+        cairo_surface_destroy(surface);
+    }
+
+    /* Rows are encoded one after the other */
+    std::vector<uint32_t> encode()
+    {
+        cairo_surface_flush(surface);
+        auto data  = cairo_image_surface_get_data(surface);
+        int stride = cairo_image_surface_get_stride(surface);
+
+        std::vector<uint32_t> out;
+        for (int y = 0; y < TILE_SIZE; y++)
+        {
+            rle_encode((const uint32_t*)(data + y * stride), TILE_SIZE, out);
+        }
+
+        out.shrink_to_fit();
+
+        return out;
+    }
+
+    void decode(const std::vector<uint32_t>& packed)
+    {
+        cairo_surface_flush(surface);
+        auto data  = cairo_image_surface_get_data(surface);
+        int stride = cairo_image_surface_get_stride(surface);
+
+        const uint32_t *in = packed.data();
+        for (int y = 0; y < TILE_SIZE; y++)
+        {
+            in = rle_decode(in, (uint32_t*)(data + y * stride), TILE_SIZE);
+        }
+
+        cairo_surface_mark_dirty(surface);
+        dirty = {0, 0, TILE_SIZE, TILE_SIZE};
+    }
+
+    /* Premultiplied, so a transparent pixel is all zero */
+    bool transparent()
+    {
+        cairo_surface_flush(surface);
+        auto data  = cairo_image_surface_get_data(surface);
+        int stride = cairo_image_surface_get_stride(surface);
+
+        for (int y = 0; y < TILE_SIZE; y++)
+        {
+            auto row = (const uint32_t*)(data + y * stride);
+            for (int x = 0; x < TILE_SIZE; x++)
+            {
+                if (row[x])
+                {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    /* Must be called with the GL context current */
+    void release_texture()
+    {
+        if (tex)
+        {
+            glDeleteTextures(1, &tex);
+            tex = 0;
+        }
+    }
+
+    void upload(bool unpack_row_length)
+    {
+        cairo_surface_flush(surface);
+        auto data  = cairo_image_surface_get_data(surface);
+        int stride = cairo_image_surface_get_stride(surface);
+
+        if (!tex)
+        {
+            glGenTextures(1, &tex);
+            glBindTexture(GL_TEXTURE_2D, tex);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, TILE_SIZE, TILE_SIZE,
+                0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+        } else if (unpack_row_length)
+        {
+            glBindTexture(GL_TEXTURE_2D, tex);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, stride / 4);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, dirty.x, dirty.y,
+                dirty.width, dirty.height, GL_RGBA, GL_UNSIGNED_BYTE,
+                data + dirty.y * stride + dirty.x * 4);
+            glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+        } else
+        {
+            glBindTexture(GL_TEXTURE_2D, tex);
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, dirty.y,
+                TILE_SIZE, dirty.height, GL_RGBA, GL_UNSIGNED_BYTE,
+                data + dirty.y * stride);
+        }
+
+        glBindTexture(GL_TEXTURE_2D, 0);
+        dirty = {0, 0, 0, 0};
+    }
+};
+
+class canvas_t
+{
+    int width = 0, height = 0;
+    int cols  = 0, rows = 0;
+    std::vector<std::unique_ptr<tile_t>> tiles;
+
+    struct packed_tile_t
+    {
+        size_t index;
+        std::vector<uint32_t> data;
+    };
+
+    std::vector<packed_tile_t> packed;
+
+    public:
+    /* Whether GL_UNPACK_ROW_LENGTH can be used for partial uploads */
+    bool unpack_row_length = false;
+
+    /* Changing the size drops the contents. Must be called with the GL
+     * context current if the canvas was uploaded. */
+    void resize(int w, int h)
+    {
+        if ((w == width) && (h == height))
+        {
+            return;
+        }
+
+        clear();
+        width  = w;
+        height = h;
+        cols   = (w + TILE_SIZE - 1) / TILE_SIZE;
+        rows   = (h + TILE_SIZE - 1) / TILE_SIZE;
+        tiles.resize(cols * rows);
+    }
+
+    int get_width() const
+    {
+        return width;
+    }
+
+    int get_height() const
+    {
+        return height;
+    }
+
+    bool empty() const
+    {
+        return packed.empty() && std::none_of(tiles.begin(), tiles.end(),
+            [] (const std::unique_ptr<tile_t>& tile) { return bool(tile); });
+    }
+
+    /*
+     * Run draw on every tile that box covers, allocating tiles as
+     * needed unless allocate is false. The context is translated and
+     * clipped, so draw works in canvas coordinates and only touches the
+     * part inside box.
+     */
+    void paint(rect_t box, const std::function<void(cairo_t*)>& draw,
+        bool allocate = true)
+    {
+        unpack();
+        box = rect_intersection(box, {0, 0, width, height});
+        if (box.empty())
+        {
+            return;
+        }
+
+        for_each_tile_in(box, [&] (int col, int row, rect_t tile_box)
+        {
+            auto& tile = tiles[row * cols + col];
+            if (!tile && !allocate)
+            {
+                return;
+            } else if (!tile)
+            {
+                tile = std::make_unique<tile_t>();
+            }
+
+            auto local = rect_intersection(box, tile_box);
+            local.x -= tile_box.x;
+            local.y -= tile_box.y;
+
+            cairo_save(tile->cr);
+            cairo_rectangle(tile->cr, local.x, local.y, local.width, local.height);
+            cairo_clip(tile->cr);
+            cairo_translate(tile->cr, -tile_box.x, -tile_box.y);
+            draw(tile->cr);
+            cairo_restore(tile->cr);
+
+            tile->dirty = rect_union(tile->dirty, local);
+        });
+    }
+
+    /* Clear box on the tiles that exist, without allocating new ones */
+    void erase(rect_t box)
+    {
+        unpack();
+        box = rect_intersection(box, {0, 0, width, height});
+        for_each_tile_in(box, [&] (int col, int row, rect_t tile_box)
+        {
+            auto& tile = tiles[row * cols + col];
+            if (!tile)
+            {
+                return;
+            }
+
+            auto local = rect_intersection(box, tile_box);
+            local.x -= tile_box.x;
+            local.y -= tile_box.y;
+
+            cairo_save(tile->cr);
+            cairo_rectangle(tile->cr, local.x, local.y, local.width, local.height);
+            cairo_set_operator(tile->cr, CAIRO_OPERATOR_CLEAR);
+            cairo_fill(tile->cr);
+            cairo_restore(tile->cr);
+
+            tile->dirty = rect_union(tile->dirty, local);
+        });
+    }
+
+    /*
+     * Free the tiles in box that are fully transparent, with their
+     * textures. Must be called with the GL context current.
+     */
+    void release_empty(rect_t box)
+    {
+        unpack();
+        box = rect_intersection(box, {0, 0, width, height});
+        for_each_tile_in(box, [&] (int col, int row, rect_t)
+        {
+            auto& tile = tiles[row * cols + col];
+            if (tile && tile->transparent())
+            {
+                tile->release_texture();
+                tile.reset();
+            }
+        });
+    }
+
+    /* Upload the drawn parts of all tiles */
+    void upload()
+    {
+        for (auto& tile : tiles)
+        {
+            if (tile && !tile->dirty.empty())
+            {
+                tile->upload(unpack_row_length);
+            }
+        }
+    }
+
+    bool is_packed() const
+    {
+        return !packed.empty();
+    }
+
+    /* Encode all tiles into CPU memory and free their surfaces and
+     * textures. Must be called with the GL context current. */
+    void pack()
+    {
+        for (size_t i = 0; i < tiles.size(); i++)
+        {
+            auto& tile = tiles[i];
+            if (tile)
+            {
+                packed.push_back({i, tile->encode()});
+                tile->release_texture();
+                tile.reset();
+            }
+        }
+    }
+
+    /* Decode the packed tiles, they are uploaded by the next upload() */
+    void unpack()
+    {
+        for (auto& p : packed)
+        {
+            tiles[p.index] = std::make_unique<tile_t>();
+            tiles[p.index]->decode(p.data);
+        }
+
+        packed.clear();
+    }
+
+    /* Free all tiles. Must be called with the GL context current. */
+    void clear()
+    {
+        packed.clear();
+        for (auto& tile : tiles)
+        {
+            if (tile)
+            {
+                tile->release_texture();
+                tile.reset();
+            }
+        }
+    }
+
+    /*
+     * Pixels of row y from x up to the right edge of its tile, or
+     * nullptr if the tile is not allocated, which means transparent.
+     * The tile surfaces must be flushed and the canvas not packed.
+     */
+    const uint32_t *pixels_at(int x, int y) const
+    {
+        auto& tile = tiles[(y / TILE_SIZE) * cols + x / TILE_SIZE];
+        if (!tile)
+        {
+            return nullptr;
+        }
+
+        auto data  = cairo_image_surface_get_data(tile->surface);
+        int stride = cairo_image_surface_get_stride(tile->surface);
+
+        return (const uint32_t*)(data + (y % TILE_SIZE) * stride) + x % TILE_SIZE;
+    }
+
+    /* Call f(tile, box) for every allocated tile, box in canvas coordinates */
+    void for_each_tile(const std::function<void(tile_t&, rect_t)>& f)
+    {
+        for (int row = 0; row < rows; row++)
+        {
+            for (int col = 0; col < cols; col++)
+            {
+                auto& tile = tiles[row * cols + col];
+                if (tile)
+                {
+                    f(*tile, {col * TILE_SIZE, row * TILE_SIZE, TILE_SIZE, TILE_SIZE});
+                }
+            }
+        }
+    }
+
+    private:
+    void for_each_tile_in(rect_t box,
+        const std::function<void(int, int, rect_t)>& f)
+    {
+        if (box.empty())
+        {
+            return;
+        }
+
+        int col1 = box.x / TILE_SIZE;
+        int row1 = box.y / TILE_SIZE;
+        int col2 = std::min((box.x + box.width - 1) / TILE_SIZE, cols - 1);
+        int row2 = std::min((box.y + box.height - 1) / TILE_SIZE, rows - 1);
+
+        for (int row = row1; row <= row2; row++)
+        {
+            for (int col = col1; col <= col2; col++)
+            {
+                f(col, row, {col * TILE_SIZE, row * TILE_SIZE, TILE_SIZE, TILE_SIZE});
+            }
+        }
+    }
+};
+}
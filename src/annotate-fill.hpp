@@ -0,0 +1,349 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+/*
+ * Scanline flood fill over a canvas. The filled area is returned as
+ * rectangles rather than painted, so it can be recorded as a stroke
+ * and redrawn, undone and saved like any other.
+ *
+ * A pixel matches when none of its channels differs from the seed
+ * pixel by more than a tolerance. Without one, the partly covered
+ * pixels along antialiased edges would be left out and show as a thin
+ * halo between the fill and the stroke around it.
+ *
+ * Runs of matching pixels are found with SIMD comparisons on the tile
+ * rows, four pixels at a time. Only the first pixel of each run is
+ * checked against the visited map, since a run is always filled as
+ * a whole.
+ */
+
+#include <tuple>
+#include <cstdlib>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+#if defined(__SSE2__)
+#define ANNOTATE_FILL_SSE2 1
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#define ANNOTATE_FILL_NEON 1
+#include <arm_neon.h>
+#endif
+
+#include "annotate-canvas.hpp"
+#include "annotate-stroke.hpp"
+
+namespace annotate
+{
+/* Whether every channel of px is within tolerance of value */
+inline bool pixel_matches(uint32_t px, uint32_t value, uint8_t tolerance)
+{
+    for (int shift = 0; shift < 32; shift += 8)
+    {
+        int a = (px >> shift) & 0xff, b = (value >> shift) & 0xff;
+        if (std::abs(a - b) > tolerance)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+#if ANNOTATE_FILL_SSE2
+/* All ones for each of the four pixels that matches */
+inline __m128i pixels_match(__m128i px, __m128i v, __m128i tolerance)
+{
+    __m128i diff = _mm_or_si128(_mm_subs_epu8(px, v), _mm_subs_epu8(v, px));
+    return _mm_cmpeq_epi32(_mm_subs_epu8(diff, tolerance), _mm_setzero_si128());
+}
+
+#elif ANNOTATE_FILL_NEON
+inline uint32x4_t pixels_match(uint32x4_t px, uint32x4_t v, uint8x16_t tolerance)
+{
+    uint8x16_t diff = vabdq_u8(vreinterpretq_u8_u32(px), vreinterpretq_u8_u32(v));
+    return vceqq_u32(vreinterpretq_u32_u8(vqsubq_u8(diff, tolerance)), vdupq_n_u32(0));
+}
+
+#endif
+
+/* How many pixels from the start of row match value, or don't if
+ * matching is false, at most count */
+inline size_t run_length(const uint32_t *row, size_t count, uint32_t value,
+    uint8_t tolerance, bool matching)
+{
+    size_t i = 0;
+#if ANNOTATE_FILL_SSE2
+    __m128i v    = _mm_set1_epi32(value);
+    __m128i tol  = _mm_set1_epi8(tolerance);
+    __m128i flip = matching ? _mm_setzero_si128() : _mm_set1_epi32(-1);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i px = _mm_loadu_si128((const __m128i*)(row + i));
+        int mask   = _mm_movemask_ps(_mm_castsi128_ps(
+            _mm_xor_si128(pixels_match(px, v, tol), flip)));
+        if (mask != 0xf)
+        {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+
+#elif ANNOTATE_FILL_NEON
+    uint32x4_t v    = vdupq_n_u32(value);
+    uint8x16_t tol  = vdupq_n_u8(tolerance);
+    uint32x4_t flip = vdupq_n_u32(matching ? 0 : ~0u);
+    for (; i + 4 <= count; i += 4)
+    {
+        uint32x4_t eq = veorq_u32(pixels_match(vld1q_u32(row + i), v, tol), flip);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u16(vmovn_u32(eq)), 0);
+        if (mask != ~0ull)
+        {
+            return i + __builtin_ctzll(~mask) / 16;
+        }
+    }
+
+#endif
+    for (; i < count; i++)
+    {
+        if (pixel_matches(row[i], value, tolerance) != matching)
+        {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/* How many pixels before end match value, at most count */
+inline size_t run_length_reverse(const uint32_t *end, size_t count, uint32_t value,
+    uint8_t tolerance)
+{
+    size_t i = 0;
+#if ANNOTATE_FILL_SSE2
+    __m128i v   = _mm_set1_epi32(value);
+    __m128i tol = _mm_set1_epi8(tolerance);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i px = _mm_loadu_si128((const __m128i*)(end - i - 4));
+        int mask   = _mm_movemask_ps(_mm_castsi128_ps(pixels_match(px, v, tol)));
+        if (mask != 0xf)
+        {
+            return i + __builtin_clz(~mask & 0xf) - 28;
+        }
+    }
+
+#elif ANNOTATE_FILL_NEON
+    uint32x4_t v   = vdupq_n_u32(value);
+    uint8x16_t tol = vdupq_n_u8(tolerance);
+    for (; i + 4 <= count; i += 4)
+    {
+        uint32x4_t eq = pixels_match(vld1q_u32(end - i - 4), v, tol);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u16(vmovn_u32(eq)), 0);
+        if (mask != ~0ull)
+        {
+            return i + __builtin_clzll(~mask) / 16;
+        }
+    }
+
+#endif
+    for (; i < count; i++)
+    {
+        if (!pixel_matches(end[-1 - (ptrdiff_t)i], value, tolerance))
+        {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/* First x from x on row y, before limit, where pixels stop matching
+ * value, or start matching it if matching is false */
+inline int scan_right(const canvas_t& canvas, int x, int y, int limit,
+    uint32_t value, uint8_t tolerance, bool matching)
+{
+    bool empty_matches = pixel_matches(0, value, tolerance) == matching;
+    while (x < limit)
+    {
+        int count = std::min((x / TILE_SIZE + 1) * TILE_SIZE, limit) - x;
+        auto row  = canvas.pixels_at(x, y);
+        int run   = row ? run_length(row, count, value, tolerance, matching) :
+            (empty_matches ? count : 0);
+        x += run;
+        if (run < count)
+        {
+            break;
+        }
+    }
+
+    return x;
+}
+
+/* Leftmost x' <= x with every pixel from x' to x - 1 matching value */
+inline int scan_left(const canvas_t& canvas, int x, int y, uint32_t value,
+    uint8_t tolerance)
+{
+    bool empty_matches = pixel_matches(0, value, tolerance);
+    while (x > 0)
+    {
+        int start = (x - 1) / TILE_SIZE * TILE_SIZE;
+        int count = x - start;
+        auto row  = canvas.pixels_at(start, y);
+        int run   = row ? run_length_reverse(row + count, count, value, tolerance) :
+            (empty_matches ? count : 0);
+        x -= run;
+        if (run < count)
+        {
+            break;
+        }
+    }
+
+    return x;
+}
+
+/*
+ * The 4-connected area of pixels matching the one at (x, y), as pairs
+ * of top left and bottom right corners of rectangles covering it. Rows
+ * with the same extent are merged into one rectangle.
+ */
+inline std::vector<point_t> flood_fill(canvas_t& canvas, int x, int y,
+    uint8_t tolerance = 0)
+{
+    int width  = canvas.get_width();
+    int height = canvas.get_height();
+    if ((x < 0) || (y < 0) || (x >= width) || (y >= height))
+    {
+        return {};
+    }
+
+    canvas.unpack();
+    canvas.for_each_tile([] (tile_t& tile, rect_t)
+    {
+        cairo_surface_flush(tile.surface);
+    });
+
+    auto seed = canvas.pixels_at(x, y);
+    uint32_t value = seed ? *seed : 0;
+
+    std::vector<uint64_t> visited(((size_t)width * height + 63) / 64);
+    auto is_visited = [&] (int px, int py)
+    {
+        size_t bit = (size_t)py * width + px;
+        return (visited[bit / 64] >> (bit % 64)) & 1;
+    };
+
+    auto mark = [&] (int x1, int x2, int py)
+    {
+        size_t bit = (size_t)py * width + x1, end = (size_t)py * width + x2;
+        for (; (bit < end) && (bit % 64); bit++)
+        {
+            visited[bit / 64] |= 1ull << (bit % 64);
+        }
+
+        for (; bit + 64 <= end; bit += 64)
+        {
+            visited[bit / 64] = ~0ull;
+        }
+
+        for (; bit < end; bit++)
+        {
+            visited[bit / 64] |= 1ull << (bit % 64);
+        }
+    };
+
+    struct span_t
+    {
+        int x1, x2, y;
+    };
+
+    std::vector<span_t> spans;
+    std::vector<std::pair<int, int>> stack = {{x, y}};
+    while (!stack.empty())
+    {
+        auto [sx, sy] = stack.back();
+        stack.pop_back();
+        if (is_visited(sx, sy))
+        {
+            continue;
+        }
+
+        int x1 = scan_left(canvas, sx, sy, value, tolerance);
+        int x2 = scan_right(canvas, sx, sy, width, value, tolerance, true);
+        mark(x1, x2, sy);
+        spans.push_back({x1, x2, sy});
+
+        /* One seed per run of matching pixels next to the span */
+        for (int ny : {sy - 1, sy + 1})
+        {
+            if ((ny < 0) || (ny >= height))
+            {
+                continue;
+            }
+
+            int nx = x1;
+            while (true)
+            {
+                nx = scan_right(canvas, nx, ny, x2, value, tolerance, false);
+                if (nx >= x2)
+                {
+                    break;
+                }
+
+                if (!is_visited(nx, ny))
+                {
+                    stack.push_back({nx, ny});
+                }
+
+                nx = scan_right(canvas, nx, ny, x2, value, tolerance, true);
+            }
+        }
+    }
+
+    std::sort(spans.begin(), spans.end(), [] (const span_t& a, const span_t& b)
+    {
+        return std::tie(a.x1, a.x2, a.y) < std::tie(b.x1, b.x2, b.y);
+    });
+
+    std::vector<point_t> rects;
+    for (size_t i = 0; i < spans.size();)
+    {
+        size_t j = i + 1;
+        while ((j < spans.size()) && (spans[j].x1 == spans[i].x1) &&
+               (spans[j].x2 == spans[i].x2) && (spans[j].y == spans[j - 1].y + 1))
+        {
+            j++;
+        }
+
+        rects.push_back({(float)spans[i].x1, (float)spans[i].y});
+        rects.push_back({(float)spans[i].x2, (float)spans[j - 1].y + 1});
+        i = j;
+    }
+
+    return rects;
+}
+}
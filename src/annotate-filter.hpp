@@ -0,0 +1,209 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+/*
+ * Input filtering for freehand strokes: a one-euro filter smooths the
+ * pointer while drawing, and Ramer-Douglas-Peucker decimation drops
+ * the points that do not change the shape once the stroke is done.
+ */
+
+#include <cmath>
+#include <vector>
+#include <cstdint>
+
+#include "annotate-stroke.hpp"
+
+namespace annotate
+{
+/*
+ * Casiez et al. one-euro filter: low jitter when the pointer moves
+ * slowly, low lag when it moves fast.
+ */
+class one_euro_filter_t
+{
+    double min_cutoff, beta, d_cutoff;
+    bool initialized = false;
+    double last_value = 0, last_derivative = 0;
+
+    static double alpha(double cutoff, double dt)
+    {
+        double tau = 1.0 / (2 * M_PI * cutoff);
+        return 1.0 / (1.0 + tau / dt);
+    }
+
+    public:
+    one_euro_filter_t(double min_cutoff = 1.0, double beta = 0.0,
+        double d_cutoff = 1.0) :
+        min_cutoff(min_cutoff), beta(beta), d_cutoff(d_cutoff)
+    {}
+
+    void reset()
+    {
+        initialized = false;
+    }
+
+    /* dt in seconds */
+    double filter(double value, double dt)
+    {
+        if (!initialized)
+        {
+            initialized     = true;
+            last_value      = value;
+            last_derivative = 0;
+            return value;
+        }
+
+        dt = std::max(dt, 1e-4);
+
+        double a_d = alpha(d_cutoff, dt);
+        double derivative = a_d * (value - last_value) / dt +
+            (1 - a_d) * last_derivative;
+
+        double a = alpha(min_cutoff + beta * std::abs(derivative), dt);
+        last_value = a * value + (1 - a) * last_value;
+        last_derivative = derivative;
+
+        return last_value;
+    }
+};
+
+/* Tuned for pointer positions in pixels */
+class point_filter_t
+{
+    one_euro_filter_t x{1.5, 0.01}, y{1.5, 0.01};
+    uint32_t last_time = 0;
+
+    public:
+    void reset(uint32_t time)
+    {
+        x.reset();
+        y.reset();
+        last_time = time;
+    }
+
+    /* time in milliseconds */
+    point_t filter(point_t p, uint32_t time)
+    {
+        double dt = (time - last_time) / 1000.0;
+        last_time = time;
+
+        return {(float)x.filter(p.x, dt), (float)y.filter(p.y, dt)};
+    }
+};
+
+inline float segment_distance(point_t p, point_t a, point_t b)
+{
+    float dx = b.x - a.x, dy = b.y - a.y;
+    float len2 = dx * dx + dy * dy;
+    if (len2 == 0)
+    {
+        return std::hypot(p.x - a.x, p.y - a.y);
+    }
+
+    float t = std::clamp(((p.x - a.x) * dx + (p.y - a.y) * dy) / len2, 0.0f, 1.0f);
+
+    return std::hypot(p.x - (a.x + t * dx), p.y - (a.y + t * dy));
+}
+
+/* Ramer-Douglas-Peucker, returns the indices of the points to keep */
+inline std::vector<size_t> decimate_indices(const std::vector<point_t>& points,
+    float epsilon)
+{
+    std::vector<bool> keep(points.size(), epsilon <= 0);
+    if (points.size() < 3)
+    {
+        keep.assign(points.size(), true);
+    }
+
+    if (points.empty())
+    {
+        return {};
+    }
+
+    std::vector<std::pair<size_t, size_t>> ranges;
+    if (!keep.front())
+    {
+        ranges.push_back({0, points.size() - 1});
+    }
+
+    keep.front() = keep.back() = true;
+
+    while (!ranges.empty())
+    {
+        auto [first, last] = ranges.back();
+        ranges.pop_back();
+
+        float max_dist = 0;
+        size_t index   = first;
+        for (size_t i = first + 1; i < last; i++)
+        {
+            float dist = segment_distance(points[i], points[first], points[last]);
+            if (dist > max_dist)
+            {
+                max_dist = dist;
+                index    = i;
+            }
+        }
+
+        if (max_dist > epsilon)
+        {
+            keep[index] = true;
+            ranges.push_back({first, index});
+            ranges.push_back({index, last});
+        }
+    }
+
+    std::vector<size_t> result;
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        if (keep[i])
+        {
+            result.push_back(i);
+        }
+    }
+
+    return result;
+}
+
+template<class T>
+inline std::vector<T> select(const std::vector<T>& values, const std::vector<size_t>& indices)
+{
+    std::vector<T> result;
+    result.reserve(indices.size());
+    for (size_t i : indices)
+    {
+        result.push_back(values[i]);
+    }
+
+    return result;
+}
+
+inline std::vector<point_t> decimate(const std::vector<point_t>& points, float epsilon)
+{
+    return select(points, decimate_indices(points, epsilon));
+}
+}
@@ -0,0 +1,311 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+/*
+ * Undo/redo for a workspace's stroke list. Entries are stroke records,
+ * never bitmaps, so undoing a stroke only touches the area it covered.
+ * The memory taken by the history is bounded, the oldest entries are
+ * dropped first when it goes over budget.
+ *
+ * Every change to the stroke list bumps a generation, so work started
+ * on a copy of the strokes can tell whether it is still current. Changes
+ * made without the history, like extending the stroke being drawn, call
+ * touch().
+ */
+
+#include <deque>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+#include "annotate-stroke.hpp"
+
+namespace annotate
+{
+inline size_t stroke_size(const stroke_t& stroke)
+{
+    return sizeof(stroke_t) +
+           stroke.points.capacity() * sizeof(point_t) +
+           stroke.widths.capacity() * sizeof(float) +
+           stroke.triangles.capacity() * sizeof(float);
+}
+
+class history_t
+{
+    enum action_t
+    {
+        ACTION_ADD,
+        ACTION_CLEAR,
+    };
+
+    struct entry_t
+    {
+        action_t action;
+        /*
+         * Strokes that are not in the stroke list while the entry is
+         * on its stack: the undone stroke of an ADD on the redo stack,
+         * or the cleared strokes of a CLEAR on the undo stack.
+         */
+        std::vector<stroke_t> strokes;
+        size_t size = sizeof(entry_t);
+    };
+
+    std::deque<entry_t> undo_stack, redo_stack;
+    size_t used   = 0;
+    size_t budget = 0;
+    uint64_t changes = 0;
+
+    public:
+    void set_budget(size_t bytes)
+    {
+        budget = bytes;
+        trim();
+    }
+
+    size_t get_used() const
+    {
+        return used;
+    }
+
+    uint64_t generation() const
+    {
+        return changes;
+    }
+
+    /* The stroke list was changed some other way */
+    void touch()
+    {
+        changes++;
+    }
+
+    /* A stroke was appended to the list */
+    void record_stroke()
+    {
+        changes++;
+        drop_redo();
+        push(undo_stack, {ACTION_ADD, {}});
+        trim();
+    }
+
+    /* Move all strokes out of the list so the clear can be undone */
+    void record_clear(std::vector<stroke_t>& strokes)
+    {
+        changes++;
+        drop_redo();
+        push(undo_stack, {ACTION_CLEAR, take_all(strokes)});
+        trim();
+    }
+
+    /* Revert the last action, returns the area it changed */
+    rect_t undo(std::vector<stroke_t>& strokes)
+    {
+        if (undo_stack.empty())
+        {
+            return {0, 0, 0, 0};
+        }
+
+        entry_t entry = pop(undo_stack);
+        rect_t changed;
+        if ((entry.action == ACTION_ADD) && strokes.empty())
+        {
+            return {0, 0, 0, 0};
+        } else if (entry.action == ACTION_ADD)
+        {
+            changed = stroke_bounds(strokes.back());
+            entry.strokes.push_back(take_last(strokes));
+        } else
+        {
+            changed = restore_all(strokes, entry.strokes);
+        }
+
+        push(redo_stack, std::move(entry));
+        trim();
+        changes++;
+
+        return changed;
+    }
+
+    /* Apply the last undone action again, returns the area it changed */
+    rect_t redo(std::vector<stroke_t>& strokes)
+    {
+        if (redo_stack.empty())
+        {
+            return {0, 0, 0, 0};
+        }
+
+        entry_t entry = pop(redo_stack);
+        rect_t changed;
+        if (entry.action == ACTION_ADD)
+        {
+            changed = restore_all(strokes, entry.strokes);
+        } else
+        {
+            changed = bounds_of(strokes);
+            entry.strokes = take_all(strokes);
+        }
+
+        push(undo_stack, std::move(entry));
+        trim();
+        changes++;
+
+        return changed;
+    }
+
+    /* For strokes that have to follow a change of the coordinate space */
+    void for_each_stroke(const std::function<void(stroke_t&)>& f)
+    {
+        changes++;
+        for (auto stack : {&undo_stack, &redo_stack})
+        {
+            for (auto& entry : *stack)
+            {
+                std::for_each(entry.strokes.begin(), entry.strokes.end(), f);
+            }
+        }
+    }
+
+    void clear()
+    {
+        undo_stack.clear();
+        redo_stack.clear();
+        used = 0;
+    }
+
+    private:
+    static rect_t bounds_of(const std::vector<stroke_t>& strokes)
+    {
+        rect_t box = {0, 0, 0, 0};
+        for (auto& stroke : strokes)
+        {
+            box = rect_union(box, stroke_bounds(stroke));
+        }
+
+        return box;
+    }
+
+    /* Triangles are dropped, they are rebuilt if the stroke comes back */
+    static stroke_t release(stroke_t stroke)
+    {
+        stroke.triangles.clear();
+        stroke.triangles.shrink_to_fit();
+        stroke.tessellated = 0;
+
+        return stroke;
+    }
+
+    static stroke_t take_last(std::vector<stroke_t>& strokes)
+    {
+        stroke_t stroke = release(std::move(strokes.back()));
+        strokes.pop_back();
+
+        return stroke;
+    }
+
+    static std::vector<stroke_t> take_all(std::vector<stroke_t>& strokes)
+    {
+        std::vector<stroke_t> taken;
+        for (auto& stroke : strokes)
+        {
+            taken.push_back(release(std::move(stroke)));
+        }
+
+        strokes.clear();
+
+        return taken;
+    }
+
+    static rect_t restore_all(std::vector<stroke_t>& strokes,
+        std::vector<stroke_t>& from)
+    {
+        rect_t box = bounds_of(from);
+        for (auto& stroke : from)
+        {
+            strokes.push_back(std::move(stroke));
+        }
+
+        from.clear();
+
+        return box;
+    }
+
+    static size_t entry_size(const entry_t& entry)
+    {
+        size_t size = sizeof(entry_t);
+        for (auto& stroke : entry.strokes)
+        {
+            size += stroke_size(stroke);
+        }
+
+        return size;
+    }
+
+    void push(std::deque<entry_t>& stack, entry_t entry)
+    {
+        entry.size = entry_size(entry);
+        used += entry.size;
+        stack.push_back(std::move(entry));
+    }
+
+    entry_t pop(std::deque<entry_t>& stack)
+    {
+        entry_t entry = std::move(stack.back());
+        stack.pop_back();
+        used -= entry.size;
+
+        return entry;
+    }
+
+    void drop_redo()
+    {
+        for (auto& entry : redo_stack)
+        {
+            used -= entry.size;
+        }
+
+        redo_stack.clear();
+    }
+
+    /*
+     * Undo entries are dropped oldest first. Once they are gone, the
+     * redo entries furthest from the current state go next.
+     */
+    void trim()
+    {
+        while ((used > budget) && !undo_stack.empty())
+        {
+            used -= undo_stack.front().size;
+            undo_stack.pop_front();
+        }
+
+        while ((used > budget) && !redo_stack.empty())
+        {
+            used -= redo_stack.front().size;
+            redo_stack.pop_front();
+        }
+    }
+};
+}
@@ -0,0 +1,294 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+/*
+ * Trail of the laser pointer. Each vertex carries the time its point
+ * was drawn, and the shader computes the alpha from its age, so the
+ * geometry only changes when segments are added or expire. Segments
+ * are added and expire in the same order, so they are kept in one
+ * vertex array that is consumed from the front.
+ */
+
+#include <cmath>
+#include <deque>
+#include <vector>
+#include <cstdint>
+#include <initializer_list>
+
+#include "annotate-stroke.hpp"
+
+namespace annotate
+{
+class laser_t
+{
+    struct segment_t
+    {
+        uint32_t time;
+        /* Past the last float of its vertices */
+        size_t end;
+        rect_t bounds;
+    };
+
+    /* x, y and time since base for each vertex, as a triangle list */
+    std::vector<float> vertices;
+    std::deque<segment_t> segments;
+    /* First float of the first live segment */
+    size_t first = 0;
+    /* Times are relative to this, so they fit a float */
+    uint32_t base = 0;
+    /* End of the trail, the next segment starts from its edges */
+    point_t last = {0, 0}, left = {0, 0}, right = {0, 0};
+    /* Direction and length of the last segment, and how far along it
+     * the inner corner of its start was moved by a miter */
+    point_t last_dir = {0, 0};
+    float last_len   = 0, last_inset = 0;
+    uint32_t last_time = 0;
+    bool joined = false;
+
+    /* Longest miter, in half widths, before a join is beveled */
+    static constexpr float MITER_LIMIT = 2.0f;
+
+    void push(point_t p, float time)
+    {
+        vertices.insert(vertices.end(), {p.x, p.y, time});
+    }
+
+    static rect_t points_bounds(std::initializer_list<point_t> points)
+    {
+        float x1 = points.begin()->x, y1 = points.begin()->y;
+        float x2 = x1, y2 = y1;
+        for (auto& p : points)
+        {
+            x1 = std::min(x1, p.x);
+            y1 = std::min(y1, p.y);
+            x2 = std::max(x2, p.x);
+            y2 = std::max(y2, p.y);
+        }
+
+        return {(int)std::floor(x1) - 1, (int)std::floor(y1) - 1,
+            (int)std::ceil(x2 - x1) + 3, (int)std::ceil(y2 - y1) + 3};
+    }
+
+    /*
+     * Set left and right to where the segment in direction dir starts.
+     * A miter moves the end edge of the previous segment to where the
+     * outlines of both meet, so they neither overlap nor leave a gap.
+     * On sharp turns, or when the inner corner would move past the other
+     * end of either segment, the quads would fold over, so the new
+     * segment starts from its own normal and a bevel triangle closes
+     * the outer side instead. Returns the area of the previous segment
+     * that changed, inset is set to how far the inner corner moved.
+     */
+    rect_t join(point_t dir, float len, float hw, float t0, float& inset)
+    {
+        point_t n = {-dir.y, dir.x};
+        point_t prev_n = {-last_dir.y, last_dir.x};
+        float cos_turn = last_dir.x * dir.x + last_dir.y * dir.y;
+        float cos_half = std::sqrt(std::max((1 + cos_turn) / 2, 0.0f));
+        float tan_half = std::sqrt(std::max(1 - cos_turn, 0.0f) /
+            std::max(1 + cos_turn, 1e-6f));
+
+        inset = hw * tan_half;
+        if ((cos_half * MITER_LIMIT >= 1) && (inset <= len) &&
+            (inset + last_inset <= last_len))
+        {
+            point_t m = {prev_n.x + n.x, prev_n.y + n.y};
+            float scale = hw / (cos_half * std::hypot(m.x, m.y));
+            left  = {last.x + m.x * scale, last.y + m.y * scale};
+            right = {last.x - m.x * scale, last.y - m.y * scale};
+
+            /* The end edge of a segment is its third, fifth and sixth vertex */
+            float *v = &vertices[segments.back().end - 18];
+            v[6]  = v[12] = right.x;
+            v[7]  = v[13] = right.y;
+            v[15] = left.x;
+            v[16] = left.y;
+
+            auto& bounds = segments.back().bounds;
+            bounds = rect_union(bounds, points_bounds({left, right}));
+            return bounds;
+        }
+
+        point_t l = {last.x + n.x * hw, last.y + n.y * hw};
+        point_t r = {last.x - n.x * hw, last.y - n.y * hw};
+        /* Turning towards the normal puts the left side on the inside */
+        bool left_inner = last_dir.x * dir.y - last_dir.y * dir.x > 0;
+        push(last, t0);
+        push(left_inner ? right : left, t0);
+        push(left_inner ? r : l, t0);
+        left  = l;
+        right = r;
+        inset = 0;
+
+        return {0, 0, 0, 0};
+    }
+
+    public:
+    bool empty() const
+    {
+        return segments.empty();
+    }
+
+    /* Start a trail at p that is not connected to the previous one */
+    void begin(point_t p, uint32_t time)
+    {
+        last = p;
+        last_time = time;
+        joined    = false;
+    }
+
+    /*
+     * Extend the trail to p. The segment is joined to the end of the
+     * previous one, so they don't overlap and blend twice. Returns the
+     * area that changed.
+     */
+    rect_t add(point_t p, float width, uint32_t time)
+    {
+        float dx  = p.x - last.x, dy = p.y - last.y;
+        float len = std::hypot(dx, dy);
+        if (len < 0.5f)
+        {
+            return {0, 0, 0, 0};
+        }
+
+        /* After a pause the start of the trail has faded already */
+        if (segments.empty())
+        {
+            vertices.clear();
+            first  = 0;
+            base   = time;
+            last_time = time;
+            joined = false;
+        }
+
+        float hw = width / 2;
+        float t0 = last_time - base, t1 = time - base;
+        point_t dir = {dx / len, dy / len};
+        point_t n   = {-dir.y * hw, dir.x * hw};
+        point_t old_left = left, old_right = right;
+        rect_t changed   = {0, 0, 0, 0};
+        float inset = 0;
+        if (joined)
+        {
+            changed = join(dir, len, hw, t0, inset);
+        } else
+        {
+            left   = {last.x + n.x, last.y + n.y};
+            right  = {last.x - n.x, last.y - n.y};
+            old_left  = left;
+            old_right = right;
+            joined = true;
+        }
+
+        point_t l = {p.x + n.x, p.y + n.y};
+        point_t r = {p.x - n.x, p.y - n.y};
+        push(left, t0);
+        push(right, t0);
+        push(r, t1);
+        push(left, t0);
+        push(r, t1);
+        push(l, t1);
+
+        rect_t bounds = points_bounds({old_left, old_right, left, right, l, r});
+        segments.push_back({time, vertices.size(), bounds});
+        last  = p;
+        left  = l;
+        right = r;
+        last_dir  = dir;
+        last_len  = len;
+        last_inset = inset;
+        last_time  = time;
+
+        return rect_union(changed, bounds);
+    }
+
+    /* Drop the segments older than duration, returns the area they covered */
+    rect_t expire(uint32_t now, uint32_t duration)
+    {
+        rect_t removed = {0, 0, 0, 0};
+        while (!segments.empty() && (now - segments.front().time >= duration))
+        {
+            removed = rect_union(removed, segments.front().bounds);
+            first   = segments.front().end;
+            segments.pop_front();
+        }
+
+        if (segments.empty())
+        {
+            vertices.clear();
+            first = 0;
+        } else if (first > vertices.size() / 2)
+        {
+            vertices.erase(vertices.begin(), vertices.begin() + first);
+            for (auto& segment : segments)
+            {
+                segment.end -= first;
+            }
+
+            first = 0;
+        }
+
+        return removed;
+    }
+
+    void clear()
+    {
+        vertices.clear();
+        segments.clear();
+        first  = 0;
+        joined = false;
+    }
+
+    /* Area of the live segments, it changes every frame while they fade */
+    rect_t bounds() const
+    {
+        rect_t box = {0, 0, 0, 0};
+        for (auto& segment : segments)
+        {
+            box = rect_union(box, segment.bounds);
+        }
+
+        return box;
+    }
+
+    /* Three floats per vertex, the third is in the time base of relative_time() */
+    const float *data() const
+    {
+        return vertices.data() + first;
+    }
+
+    size_t vertex_count() const
+    {
+        return (vertices.size() - first) / 3;
+    }
+
+    /* now in the time base of the vertices */
+    float relative_time(uint32_t now) const
+    {
+        return now - base;
+    }
+};
+}
@@ -0,0 +1,259 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+/*
+ * On-disk stroke log. A file holds the strokes of one workspace on one
+ * output, together with the output size they were drawn at:
+ *
+ *   "WFAN" u32 version  u32 width  u32 height  u32 count
+ *   count times:
+ *     u32 method  u32 flags  f32 r g b a  f32 width
+ *     u32 npoints  npoints times f32 x y
+ *     with STROKE_FLAG_PRESSURE: npoints times f32 width
+ *
+ * Version 1 logs have no flags field, version 4 added fill strokes.
+ *
+ * Values are in host byte order. Files are written to a temporary name
+ * and renamed, so a crash while saving never leaves a truncated log.
+ */
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "annotate-stroke.hpp"
+
+namespace annotate
+{
+static constexpr char STORE_MAGIC[4] = {'W', 'F', 'A', 'N'};
+static constexpr uint32_t STORE_VERSION = 4;
+static constexpr uint32_t STROKE_FLAG_SMOOTH   = 1 << 0;
+static constexpr uint32_t STROKE_FLAG_PRESSURE = 1 << 1;
+
+template<class T>
+inline void store_put(std::string& out, T value)
+{
+    out.append((const char*)&value, sizeof(value));
+}
+
+template<class T>
+inline bool store_get(const char*& data, const char *end, T& value)
+{
+    if ((size_t)(end - data) < sizeof(value))
+    {
+        return false;
+    }
+
+    std::memcpy(&value, data, sizeof(value));
+    data += sizeof(value);
+
+    return true;
+}
+
+inline std::string serialize_strokes(const std::vector<stroke_t>& strokes,
+    uint32_t width, uint32_t height)
+{
+    std::string out(STORE_MAGIC, sizeof(STORE_MAGIC));
+    store_put(out, STORE_VERSION);
+    store_put(out, width);
+    store_put(out, height);
+    store_put(out, (uint32_t)strokes.size());
+
+    for (auto& stroke : strokes)
+    {
+        store_put(out, (uint32_t)stroke.method);
+        store_put(out, (stroke.smooth ? STROKE_FLAG_SMOOTH : 0) |
+            (stroke.widths.empty() ? 0 : STROKE_FLAG_PRESSURE));
+        for (float v : {stroke.r, stroke.g, stroke.b, stroke.a, stroke.width})
+        {
+            store_put(out, v);
+        }
+
+        store_put(out, (uint32_t)stroke.points.size());
+        out.append((const char*)stroke.points.data(),
+            stroke.points.size() * sizeof(point_t));
+        out.append((const char*)stroke.widths.data(),
+            stroke.widths.size() * sizeof(float));
+    }
+
+    return out;
+}
+
+/* Returns false if the data is not a complete stroke log */
+inline bool deserialize_strokes(const char *data, size_t size,
+    std::vector<stroke_t>& strokes, uint32_t& width, uint32_t& height)
+{
+    const char *end = data + size;
+    uint32_t version, count;
+
+    if ((size < sizeof(STORE_MAGIC)) ||
+        std::memcmp(data, STORE_MAGIC, sizeof(STORE_MAGIC)))
+    {
+        return false;
+    }
+
+    data += sizeof(STORE_MAGIC);
+    if (!store_get(data, end, version) || (version < 1) || (version > STORE_VERSION) ||
+        !store_get(data, end, width) || !store_get(data, end, height) ||
+        !store_get(data, end, count))
+    {
+        return false;
+    }
+
+    std::vector<stroke_t> result;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        stroke_t stroke;
+        uint32_t method, npoints, flags = 0;
+
+        if (!store_get(data, end, method) || (method > ANNOTATE_METHOD_FILL) ||
+            ((version >= 2) && !store_get(data, end, flags)) ||
+            !store_get(data, end, stroke.r) || !store_get(data, end, stroke.g) ||
+            !store_get(data, end, stroke.b) || !store_get(data, end, stroke.a) ||
+            !store_get(data, end, stroke.width) || !store_get(data, end, npoints))
+        {
+            return false;
+        }
+
+        bool shape = (method != ANNOTATE_METHOD_DRAW) &&
+            (method != ANNOTATE_METHOD_ERASE) && (method != ANNOTATE_METHOD_FILL);
+        if (((size_t)(end - data) / sizeof(point_t) < npoints) ||
+            (shape && (npoints != 2)) ||
+            ((method == ANNOTATE_METHOD_FILL) && (npoints % 2)))
+        {
+            return false;
+        }
+
+        stroke.method = (annotate_draw_method)method;
+        stroke.smooth = (method == ANNOTATE_METHOD_DRAW) && (flags & STROKE_FLAG_SMOOTH);
+        stroke.points.resize(npoints);
+        std::memcpy(stroke.points.data(), data, npoints * sizeof(point_t));
+        data += npoints * sizeof(point_t);
+
+        if (flags & STROKE_FLAG_PRESSURE)
+        {
+            if (((size_t)(end - data) / sizeof(float) < npoints) ||
+                ((method != ANNOTATE_METHOD_DRAW) && (method != ANNOTATE_METHOD_ERASE)))
+            {
+                return false;
+            }
+
+            stroke.widths.resize(npoints);
+            std::memcpy(stroke.widths.data(), data, npoints * sizeof(float));
+            data += npoints * sizeof(float);
+        }
+
+        result.push_back(std::move(stroke));
+    }
+
+    strokes = std::move(result);
+
+    return true;
+}
+
+/* Map the file and parse it, without reading it into a buffer first */
+inline bool load_strokes(const std::string& path,
+    std::vector<stroke_t>& strokes, uint32_t& width, uint32_t& height)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if ((fstat(fd, &st) < 0) || (st.st_size == 0))
+    {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    bool ok = deserialize_strokes((const char*)data, st.st_size,
+        strokes, width, height);
+    munmap(data, st.st_size);
+
+    return ok;
+}
+
+/* Write data to path atomically, an empty string removes the file */
+inline bool write_strokes_file(const std::string& path, const std::string& data)
+{
+    if (data.empty())
+    {
+        return (unlink(path.c_str()) == 0) || (errno == ENOENT);
+    }
+
+    std::string tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp)
+    {
+        return false;
+    }
+
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    ok &= fflush(fp) == 0;
+    ok &= fsync(fileno(fp)) == 0;
+    ok &= fclose(fp) == 0;
+
+    if (!ok || (rename(tmp.c_str(), path.c_str()) < 0))
+    {
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/* mkdir -p */
+inline bool make_directories(const std::string& path)
+{
+    for (size_t pos = 1; pos != std::string::npos; pos = path.find('/', pos + 1))
+    {
+        std::string dir = path.substr(0, pos);
+        if ((mkdir(dir.c_str(), 0700) < 0) && (errno != EEXIST))
+        {
+            return false;
+        }
+    }
+
+    return (mkdir(path.c_str(), 0700) == 0) || (errno == EEXIST);
+}
+}
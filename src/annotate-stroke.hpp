@@ -0,0 +1,518 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+/*
+ * Annotations are recorded as a list of strokes. A stroke can be
+ * rasterized into a canvas with cairo, or tessellated into triangles
+ * and drawn directly with GL, so no bitmap has to be kept around.
+ */
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <cairo.h>
+
+#include "annotate-canvas.hpp"
+
+namespace annotate
+{
+enum annotate_draw_method {
+    ANNOTATE_METHOD_DRAW,
+    ANNOTATE_METHOD_LINE,
+    ANNOTATE_METHOD_RECTANGLE,
+    ANNOTATE_METHOD_CIRCLE,
+    ANNOTATE_METHOD_ERASE,
+    ANNOTATE_METHOD_FILL,
+    /* Fading trail, kept by laser_t and never recorded as a stroke */
+    ANNOTATE_METHOD_LASER,
+};
+
+struct point_t
+{
+    float x, y;
+};
+
+struct stroke_t
+{
+    annotate_draw_method method = ANNOTATE_METHOD_DRAW;
+    /* Not premultiplied */
+    float r = 0, g = 0, b = 0, a = 0;
+    float width = 1;
+    /*
+     * Freehand and erase: the polyline
+     * Line: both end points
+     * Rectangle: top left and bottom right corner
+     * Circle: center and a point on the circle
+     * Fill: top left and bottom right corner of each filled rectangle
+     */
+    std::vector<point_t> points;
+    /* Freehand only, the points are joined with a Catmull-Rom spline */
+    bool smooth = false;
+    /* Freehand only, the width at each point when drawn with a pressure
+     * sensitive tool. Empty if width applies to the whole stroke. */
+    std::vector<float> widths;
+
+    /* Triangle list, two floats per vertex, and how many points of a
+     * freehand stroke it covers so far */
+    std::vector<float> triangles;
+    size_t tessellated = 0;
+};
+
+inline float stroke_radius(const stroke_t& stroke)
+{
+    return std::hypot(stroke.points[1].x - stroke.points[0].x,
+        stroke.points[1].y - stroke.points[0].y);
+}
+
+/* Bezier control points of the Catmull-Rom segment from p[i] to p[i + 1] */
+inline void catmull_rom_controls(const std::vector<point_t>& p, size_t i,
+    point_t& c1, point_t& c2)
+{
+    point_t p0 = p[i ? i - 1 : i], p1 = p[i], p2 = p[i + 1];
+    point_t p3 = p[std::min(i + 2, p.size() - 1)];
+
+    c1 = {p1.x + (p2.x - p0.x) / 6, p1.y + (p2.y - p0.y) / 6};
+    c2 = {p2.x - (p3.x - p1.x) / 6, p2.y - (p3.y - p1.y) / 6};
+}
+
+/* The spline through the points as a polyline */
+inline std::vector<point_t> flatten_spline(const std::vector<point_t>& p)
+{
+    if (p.size() < 3)
+    {
+        return p;
+    }
+
+    std::vector<point_t> out = {p[0]};
+    for (size_t i = 0; i + 1 < p.size(); i++)
+    {
+        point_t c1, c2;
+        catmull_rom_controls(p, i, c1, c2);
+
+        float len = std::hypot(p[i + 1].x - p[i].x, p[i + 1].y - p[i].y);
+        int steps = std::clamp((int)(len / 4), 1, 16);
+        for (int s = 1; s <= steps; s++)
+        {
+            float t = (float)s / steps, u = 1 - t;
+            float w0 = u * u * u, w1 = 3 * u * u * t, w2 = 3 * u * t * t, w3 = t * t * t;
+            out.push_back({
+                w0 * p[i].x + w1 * c1.x + w2 * c2.x + w3 * p[i + 1].x,
+                w0 * p[i].y + w1 * c1.y + w2 * c2.y + w3 * p[i + 1].y});
+        }
+    }
+
+    return out;
+}
+
+/* Box covering the stroke including its width */
+inline rect_t stroke_bounds(const stroke_t& stroke)
+{
+    if (stroke.smooth)
+    {
+        stroke_t flat;
+        flat.width  = stroke.width;
+        flat.points = flatten_spline(stroke.points);
+
+        return stroke_bounds(flat);
+    }
+
+    if (stroke.points.empty())
+    {
+        return {0, 0, 0, 0};
+    }
+
+    float x1, y1, x2, y2;
+    if (stroke.method == ANNOTATE_METHOD_CIRCLE)
+    {
+        float radius = stroke_radius(stroke);
+        x1 = stroke.points[0].x - radius;
+        y1 = stroke.points[0].y - radius;
+        x2 = stroke.points[0].x + radius;
+        y2 = stroke.points[0].y + radius;
+    } else
+    {
+        x1 = x2 = stroke.points[0].x;
+        y1 = y2 = stroke.points[0].y;
+        for (auto& p : stroke.points)
+        {
+            x1 = std::min(x1, p.x);
+            y1 = std::min(y1, p.y);
+            x2 = std::max(x2, p.x);
+            y2 = std::max(y2, p.y);
+        }
+    }
+
+    float max_width = stroke.widths.empty() ? stroke.width :
+        *std::max_element(stroke.widths.begin(), stroke.widths.end());
+    int padding     = std::ceil(max_width) + 1;
+
+    return {(int)std::floor(x1) - padding, (int)std::floor(y1) - padding,
+        (int)std::ceil(x2 - x1) + padding * 2 + 1,
+        (int)std::ceil(y2 - y1) + padding * 2 + 1};
+}
+
+/* Scale around the origin, then translate. Triangles are rebuilt lazily. */
+inline void transform_stroke(stroke_t& stroke, float scale, float dx, float dy)
+{
+    for (auto& p : stroke.points)
+    {
+        p = {p.x * scale + dx, p.y * scale + dy};
+    }
+
+    stroke.width *= scale;
+    for (auto& w : stroke.widths)
+    {
+        w *= scale;
+    }
+
+    stroke.triangles.clear();
+    stroke.tessellated = 0;
+}
+
+/* GLESv2 doesn't support GL_BGRA, so the color is swizzled for upload */
+inline void set_cairo_stroke(cairo_t *cr, const stroke_t& stroke)
+{
+    cairo_set_line_width(cr, stroke.width);
+    cairo_set_source_rgba(cr, stroke.b, stroke.g, stroke.r, stroke.a);
+}
+
+/* Outline of the segment a-b, with radius ra at a and rb at b */
+inline void taper_corners(point_t a, point_t b, float ra, float rb, point_t out[4])
+{
+    float dx = b.x - a.x, dy = b.y - a.y;
+    float len = std::max(std::hypot(dx, dy), 1e-3f);
+    float nx  = -dy / len, ny = dx / len;
+
+    out[0] = {a.x - nx * ra, a.y - ny * ra};
+    out[1] = {b.x - nx * rb, b.y - ny * rb};
+    out[2] = {b.x + nx * rb, b.y + ny * rb};
+    out[3] = {a.x + nx * ra, a.y + ny * ra};
+}
+
+/*
+ * A pressure stroke is a disc at every point and a tapered quad along
+ * every segment, all filled at once with the nonzero rule. The quads
+ * wind the same way as cairo_arc, so overlaps never cancel out.
+ */
+inline void rasterize_variable(cairo_t *cr, const stroke_t& stroke, size_t first)
+{
+    auto& p = stroke.points;
+    auto& w = stroke.widths;
+
+    first = first ? first - 1 : 0;
+    cairo_new_path(cr);
+    for (size_t i = first; i < p.size(); i++)
+    {
+        cairo_new_sub_path(cr);
+        cairo_arc(cr, p[i].x, p[i].y, w[i] / 2, 0, 2 * M_PI);
+        if (i > first)
+        {
+            point_t q[4];
+            taper_corners(p[i - 1], p[i], w[i - 1] / 2, w[i] / 2, q);
+            cairo_move_to(cr, q[0].x, q[0].y);
+            for (int j = 1; j < 4; j++)
+            {
+                cairo_line_to(cr, q[j].x, q[j].y);
+            }
+
+            cairo_close_path(cr);
+        }
+    }
+
+    cairo_set_fill_rule(cr, CAIRO_FILL_RULE_WINDING);
+    cairo_fill(cr);
+}
+
+/* Rasterize points [first, end) of the stroke. first > 0 continues a
+ * freehand stroke from the point before it. */
+inline void rasterize_stroke(cairo_t *cr, const stroke_t& stroke, size_t first = 0)
+{
+    auto& p = stroke.points;
+    if (p.empty())
+    {
+        return;
+    }
+
+    if (!stroke.widths.empty())
+    {
+        set_cairo_stroke(cr, stroke);
+        if (stroke.method == ANNOTATE_METHOD_ERASE)
+        {
+            cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+        }
+
+        rasterize_variable(cr, stroke, first);
+        cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+        return;
+    }
+
+    set_cairo_stroke(cr, stroke);
+    switch (stroke.method)
+    {
+      case ANNOTATE_METHOD_ERASE:
+        cairo_set_operator(cr, CAIRO_OPERATOR_CLEAR);
+        [[fallthrough]];
+
+      case ANNOTATE_METHOD_DRAW:
+        cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+        cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+        first = first ? first - 1 : 0;
+        cairo_move_to(cr, p[first].x, p[first].y);
+        for (size_t i = first + 1; i < p.size(); i++)
+        {
+            if (stroke.smooth)
+            {
+                point_t c1, c2;
+                catmull_rom_controls(p, i - 1, c1, c2);
+                cairo_curve_to(cr, c1.x, c1.y, c2.x, c2.y, p[i].x, p[i].y);
+            } else
+            {
+                cairo_line_to(cr, p[i].x, p[i].y);
+            }
+        }
+
+        break;
+
+      case ANNOTATE_METHOD_LINE:
+        cairo_move_to(cr, p[0].x, p[0].y);
+        cairo_line_to(cr, p[1].x, p[1].y);
+        break;
+
+      case ANNOTATE_METHOD_RECTANGLE:
+        cairo_rectangle(cr, p[0].x, p[0].y, p[1].x - p[0].x, p[1].y - p[0].y);
+        break;
+
+      case ANNOTATE_METHOD_CIRCLE:
+        cairo_arc(cr, p[0].x, p[0].y, stroke_radius(stroke), 0, 2 * M_PI);
+        break;
+
+      case ANNOTATE_METHOD_FILL:
+        for (size_t i = 0; i + 1 < p.size(); i += 2)
+        {
+            cairo_rectangle(cr, p[i].x, p[i].y,
+                p[i + 1].x - p[i].x, p[i + 1].y - p[i].y);
+        }
+
+        cairo_fill(cr);
+        return;
+
+      case ANNOTATE_METHOD_LASER:
+        break;
+    }
+
+    cairo_stroke(cr);
+    cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+}
+
+/* Box that rasterize_stroke(cr, stroke, first) touches */
+inline rect_t stroke_bounds_from(const stroke_t& stroke, size_t first)
+{
+    bool polyline = (stroke.method == ANNOTATE_METHOD_DRAW) ||
+        (stroke.method == ANNOTATE_METHOD_ERASE);
+    if (!polyline || (first == 0))
+    {
+        return stroke_bounds(stroke);
+    }
+
+    stroke_t part;
+    part.width  = stroke.width;
+    part.points = {stroke.points.begin() + first - 1, stroke.points.end()};
+    if (!stroke.widths.empty())
+    {
+        part.widths = {stroke.widths.begin() + first - 1, stroke.widths.end()};
+    }
+
+    return stroke_bounds(part);
+}
+
+/* Draw the stroke into the canvas, erasing never allocates tiles */
+inline rect_t paint_stroke(canvas_t& canvas, const stroke_t& stroke, size_t first = 0)
+{
+    rect_t box = stroke_bounds_from(stroke, first);
+    canvas.paint(box, [&] (cairo_t *cr)
+    {
+        rasterize_stroke(cr, stroke, first);
+    }, stroke.method != ANNOTATE_METHOD_ERASE);
+
+    return box;
+}
+
+/* Draw the part of the whole stroke inside clip */
+inline void paint_stroke_clipped(canvas_t& canvas, const stroke_t& stroke, rect_t clip)
+{
+    rect_t box = rect_intersection(clip, stroke_bounds(stroke));
+    if (box.empty())
+    {
+        return;
+    }
+
+    canvas.paint(box, [&] (cairo_t *cr)
+    {
+        rasterize_stroke(cr, stroke);
+    }, stroke.method != ANNOTATE_METHOD_ERASE);
+}
+
+inline void push_quad(std::vector<float>& out, point_t a, point_t b, point_t c, point_t d)
+{
+    out.insert(out.end(), {a.x, a.y, b.x, b.y, c.x, c.y, a.x, a.y, c.x, c.y, d.x, d.y});
+}
+
+/* Quad around the segment a-b, extended by extend at both ends */
+inline void push_segment(std::vector<float>& out, point_t a, point_t b,
+    float half_width, float extend = 0)
+{
+    float dx = b.x - a.x, dy = b.y - a.y;
+    float len = std::hypot(dx, dy);
+    if (len < 1e-3)
+    {
+        return;
+    }
+
+    dx /= len;
+    dy /= len;
+    float nx = -dy * half_width, ny = dx * half_width;
+    a = {a.x - dx * extend, a.y - dy * extend};
+    b = {b.x + dx * extend, b.y + dy * extend};
+
+    push_quad(out, {a.x + nx, a.y + ny}, {b.x + nx, b.y + ny},
+        {b.x - nx, b.y - ny}, {a.x - nx, a.y - ny});
+}
+
+inline int circle_segments(float radius)
+{
+    return std::clamp((int)(radius * 0.75f), 8, 128);
+}
+
+inline void push_disc(std::vector<float>& out, point_t c, float radius)
+{
+    int n = circle_segments(radius);
+    for (int i = 0; i < n; i++)
+    {
+        float a1 = 2 * M_PI * i / n, a2 = 2 * M_PI * (i + 1) / n;
+        out.insert(out.end(), {c.x, c.y,
+            c.x + radius * std::cos(a1), c.y + radius * std::sin(a1),
+            c.x + radius * std::cos(a2), c.y + radius * std::sin(a2)});
+    }
+}
+
+/*
+ * Bring stroke.triangles up to date. Erase strokes have none, they
+ * only exist in a canvas. Freehand strokes are extended
+ * with the points added since the last call, with round joins, other
+ * strokes are tessellated once with the same joins cairo uses for them.
+ */
+inline void tessellate_stroke(stroke_t& stroke)
+{
+    auto& out = stroke.triangles;
+    float hw  = stroke.width / 2;
+
+    if (stroke.tessellated >= stroke.points.size())
+    {
+        return;
+    }
+
+    /* A smooth stroke is complete, its spline is tessellated at once */
+    std::vector<point_t> flat;
+    if (stroke.smooth)
+    {
+        flat = flatten_spline(stroke.points);
+        out.clear();
+    }
+
+    auto& p = stroke.smooth ? flat : stroke.points;
+
+    switch (stroke.method)
+    {
+      case ANNOTATE_METHOD_DRAW:
+        for (size_t i = stroke.smooth ? 0 : stroke.tessellated; i < p.size(); i++)
+        {
+            float r = stroke.widths.empty() ? hw : stroke.widths[i] / 2;
+            if ((i > 0) && !stroke.widths.empty())
+            {
+                point_t q[4];
+                taper_corners(p[i - 1], p[i], stroke.widths[i - 1] / 2, r, q);
+                push_quad(out, q[0], q[1], q[2], q[3]);
+            } else if (i > 0)
+            {
+                push_segment(out, p[i - 1], p[i], hw);
+            }
+
+            push_disc(out, p[i], r);
+        }
+
+        break;
+
+      case ANNOTATE_METHOD_LINE:
+        push_segment(out, p[0], p[1], hw);
+        break;
+
+      case ANNOTATE_METHOD_ERASE:
+      case ANNOTATE_METHOD_LASER:
+        break;
+
+      case ANNOTATE_METHOD_RECTANGLE:
+      {
+        point_t tl = p[0], br = p[1];
+        point_t tr = {br.x, tl.y}, bl = {tl.x, br.y};
+        push_segment(out, tl, tr, hw, hw);
+        push_segment(out, bl, br, hw, hw);
+        push_segment(out, tl, bl, hw);
+        push_segment(out, tr, br, hw);
+        break;
+      }
+
+      case ANNOTATE_METHOD_CIRCLE:
+      {
+        float radius = stroke_radius(stroke);
+        float inner  = std::max(radius - hw, 0.0f), outer = radius + hw;
+        int n = circle_segments(outer);
+        for (int i = 0; i < n; i++)
+        {
+            float a1 = 2 * M_PI * i / n, a2 = 2 * M_PI * (i + 1) / n;
+            float c1 = std::cos(a1), s1 = std::sin(a1);
+            float c2 = std::cos(a2), s2 = std::sin(a2);
+            push_quad(out,
+                {p[0].x + inner * c1, p[0].y + inner * s1},
+                {p[0].x + outer * c1, p[0].y + outer * s1},
+                {p[0].x + outer * c2, p[0].y + outer * s2},
+                {p[0].x + inner * c2, p[0].y + inner * s2});
+        }
+
+        break;
+      }
+
+      case ANNOTATE_METHOD_FILL:
+        for (size_t i = 0; i + 1 < p.size(); i += 2)
+        {
+            push_quad(out, p[i], {p[i + 1].x, p[i].y}, p[i + 1], {p[i].x, p[i + 1].y});
+        }
+
+        break;
+    }
+
+    stroke.tessellated = stroke.points.size();
+}
+}
@@ -0,0 +1,144 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+/*
+ * Runs one job at a time on a thread and calls back on the main loop
+ * when it is done. Completion is signaled through an eventfd watched
+ * by the wayland event loop, like wallpaper does for its downloads.
+ */
+
+#include <memory>
+#include <thread>
+#include <cstdint>
+#include <functional>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <wayland-server-core.h>
+
+namespace annotate
+{
+class worker_t
+{
+    int fd = -1;
+    wl_event_source *source = nullptr;
+    std::unique_ptr<std::thread> thread = nullptr;
+    std::function<void()> done;
+
+    static int thread_done(int fd, uint32_t mask, void *data)
+    {
+        worker_t& worker = *((worker_t*)data);
+
+        if (mask & WL_EVENT_READABLE)
+        {
+            uint64_t count;
+            read(fd, &count, sizeof(count));
+        }
+
+        worker.finish();
+
+        return 0;
+    }
+
+    void finish()
+    {
+        if (!thread)
+        {
+            return;
+        }
+
+        thread->join();
+        thread.reset();
+
+        auto callback = std::move(done);
+        done = nullptr;
+        if (callback)
+        {
+            callback();
+        }
+    }
+
+    public:
+    bool init(wl_event_loop *loop)
+    {
+        if ((fd = eventfd(0, EFD_CLOEXEC)) == -1)
+        {
+            return false;
+        }
+
+        source = wl_event_loop_add_fd(loop, fd, WL_EVENT_READABLE, thread_done, this);
+
+        return true;
+    }
+
+    /* Whether run() can be called now */
+    bool ready() const
+    {
+        return (fd != -1) && !thread;
+    }
+
+    /* job runs on the thread, on_done on the main loop afterwards */
+    void run(std::function<void()> job, std::function<void()> on_done)
+    {
+        int signal_fd = fd;
+
+        done   = std::move(on_done);
+        thread = std::make_unique<std::thread> ([job = std::move(job), signal_fd] ()
+        {
+            job();
+
+            uint64_t one = 1;
+            write(signal_fd, &one, sizeof(one));
+        });
+    }
+
+    /* Block until the running job is done and call its on_done */
+    void wait()
+    {
+        finish();
+    }
+
+    /* on_done of the last job may not start another one */
+    void fini()
+    {
+        int signal_fd = fd;
+
+        fd = -1;
+        wait();
+
+        if (source)
+        {
+            wl_event_source_remove(source);
+            source = nullptr;
+        }
+
+        if (signal_fd != -1)
+        {
+            close(signal_fd);
+        }
+    }
+};
+}
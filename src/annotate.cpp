@@ -24,29 +24,227 @@
 
 #include <map>
 #include <math.h>
+#include <cstring>
+#include <unistd.h>
 #include <wayfire/util.hpp>
 #include <wayfire/plugin.hpp>
 #include <wayfire/output.hpp>
+#include <wayfire/opengl.hpp>
 #include <wayfire/output-layout.hpp>
 #include <wayfire/render-manager.hpp>
 #include <wayfire/workspace-stream.hpp>
 #include <wayfire/workspace-manager.hpp>
 #include <wayfire/signal-definitions.hpp>
 #include <wayfire/plugins/common/cairo-util.hpp>
+#include <wayfire/util/log.hpp>
+#include <glm/gtc/matrix_transform.hpp>
 
-enum annotate_draw_method {
-    ANNOTATE_METHOD_DRAW,
-    ANNOTATE_METHOD_LINE,
-    ANNOTATE_METHOD_RECTANGLE,
-    ANNOTATE_METHOD_CIRCLE,
+extern "C"
+{
+#include <wlr/types/wlr_tablet_tool.h>
+}
+
+#include "annotate-canvas.hpp"
+#include "annotate-stroke.hpp"
+#include "annotate-filter.hpp"
+#include "annotate-history.hpp"
+#include "annotate-store.hpp"
+#include "annotate-worker.hpp"
+#include "annotate-laser.hpp"
+#include "annotate-fill.hpp"
+
+#define SAVE_DELAY 1000
+#define EVICT_DELAY 3000
+
+static const char* stroke_vertex_shader =
+R"(
+#version 100
+
+attribute mediump vec2 position;
+attribute mediump vec4 color;
+
+varying mediump vec4 v_color;
+
+uniform mat4 matrix;
+
+void main() {
+
+   v_color = color;
+   gl_Position = matrix * vec4(position.xy, 0.0, 1.0);
+}
+)";
+
+static const char* stroke_fragment_shader =
+R"(
+#version 100
+@builtin_ext@
+@builtin@
+
+precision mediump float;
+
+varying mediump vec4 v_color;
+
+void main()
+{
+    gl_FragColor = v_color;
+}
+)";
+
+static const char* preview_vertex_shader =
+R"(
+#version 100
+
+attribute highp vec2 position;
+
+uniform mat4 matrix;
+
+varying highp vec2 local;
+
+void main() {
+
+   local = position;
+   gl_Position = matrix * vec4(position.xy, 0.0, 1.0);
+}
+)";
+
+/*
+ * Antialiased outline of a line, rectangle or circle from its signed
+ * distance, so the shape being dragged needs no bitmap. The joins and
+ * caps match what cairo produces once the shape is rasterized.
+ */
+static const char* preview_fragment_shader =
+R"(
+#version 100
+@builtin_ext@
+@builtin@
+
+#ifdef GL_FRAGMENT_PRECISION_HIGH
+precision highp float;
+#else
+precision mediump float;
+#endif
+
+varying vec2 local;
+
+uniform int shape;
+uniform vec2 p0;
+uniform vec2 p1;
+uniform float radius;
+uniform float half_width;
+uniform vec4 color;
+
+float box_distance(vec2 q, vec2 half_size)
+{
+    vec2 d = abs(q) - half_size;
+    return max(d.x, d.y);
+}
+
+void main()
+{
+    float dist;
+
+    if (shape == 1)
+    {
+        vec2 dir   = p1 - p0;
+        float len  = max(length(dir), 0.001);
+        vec2 q     = local - p0;
+        dir /= len;
+        float along  = dot(q, dir);
+        float across = abs(dir.x * q.y - dir.y * q.x);
+        dist = max(across - half_width, max(-along, along - len));
+    } else if (shape == 2)
+    {
+        vec2 half_size = abs(p1 - p0) * 0.5;
+        vec2 q = local - (p0 + p1) * 0.5;
+        dist = max(box_distance(q, half_size + half_width),
+            -box_distance(q, half_size - half_width));
+    } else
+    {
+        dist = abs(length(local - p0) - radius) - half_width;
+    }
+
+    gl_FragColor = color * clamp(0.5 - dist, 0.0, 1.0);
+}
+)";
+
+/* The alpha of a laser vertex follows from its age, nothing is
+ * uploaded while the trail fades */
+static const char* laser_vertex_shader =
+R"(
+#version 100
+
+attribute highp vec3 position;
+
+uniform mat4 matrix;
+uniform highp float now;
+uniform highp float duration;
+
+varying mediump float alpha;
+
+void main() {
+
+   alpha = clamp(1.0 - (now - position.z) / duration, 0.0, 1.0);
+   gl_Position = matrix * vec4(position.xy, 0.0, 1.0);
+}
+)";
+
+static const char* laser_fragment_shader =
+R"(
+#version 100
+@builtin_ext@
+@builtin@
+
+precision mediump float;
+
+varying mediump float alpha;
+
+uniform mediump vec4 color;
+
+void main()
+{
+    gl_FragColor = color * alpha;
+}
+)";
+
+/* Vertices of one stroke in the vertex buffer of its workspace */
+struct stroke_range_t
+{
+    GLint first;
+    GLsizei count;
+    annotate::rect_t bounds;
 };
 
 class anno_ws_overlay
 {
     public:
-    cairo_t *cr = nullptr;
-    cairo_surface_t *cairo_surface;
-    std::unique_ptr<wf::simple_texture_t> texture;
+    /* Every stroke drawn on the workspace, in output-local coordinates */
+    std::vector<annotate::stroke_t> strokes;
+    /* Rasterized strokes, only used in raster mode */
+    annotate::canvas_t canvas;
+    annotate::history_t history;
+    /* A saved log exists that was not loaded yet */
+    bool restore_pending = false;
+    /* Whether a saved log was looked for, the strokes in memory are the
+     * current ones from then on */
+    bool log_checked = false;
+    /* Changed since the last save */
+    bool dirty = false;
+    /* Output size the stroke coordinates are relative to */
+    int width = 0, height = 0;
+    /* The canvas is being rasterized on the worker, or is out of date
+     * and waits for it. Strokes are drawn as triangles meanwhile. */
+    bool rebuilding = false;
+    bool needs_rebuild = false;
+    /* Triangles of every stroke, in stroke order, with the color in each
+     * vertex, used while the canvas isn't current. New strokes and points
+     * are appended, any other change sets vertices_stale to upload them
+     * all again. */
+    GLuint vbo = 0;
+    size_t vbo_capacity = 0, vbo_used = 0;
+    std::vector<stroke_range_t> ranges;
+    bool vertices_stale = true;
+    /* When the workspace was last part of a workspace stream */
+    uint32_t last_shown = 0;
 };
 
 class wayfire_annotate_screen : public wf::plugin_interface_t
@@ -54,16 +252,46 @@ class wayfire_annotate_screen : public wf::plugin_interface_t
     uint32_t button;
     wlr_box last_bbox;
     bool hook_set = false;
-    anno_ws_overlay shape_overlay;
-    annotate_draw_method draw_method;
+    bool motion_hook_set = false;
+    bool laser_hook_set = false;
+    bool unpack_row_length = false;
+    bool preview_active = false;
+    /* Shape being dragged, drawn with preview_program until release */
+    annotate::stroke_t preview;
+    annotate::annotate_draw_method draw_method;
     wf::pointf_t grab_point, last_cursor;
+    /* Motion since the last frame, drawn at once by flush_motion */
+    std::vector<wf::pointf_t> pending_motion;
+    /* Tablet pressure for each queued position, -1 if there was none */
+    std::vector<float> pending_pressure;
+    float tablet_pressure = -1;
+    annotate::point_filter_t motion_filter;
+    /* Fading trail of the laser method, on the current workspace */
+    annotate::laser_t laser;
+    OpenGL::program_t stroke_program, preview_program, laser_program;
     std::vector<std::vector<anno_ws_overlay>> overlays;
+    wf::wl_timer save_timer, evict_timer;
+    /* Loads the logs of workspaces first shown in a workspace stream */
+    wf::wl_idle_call idle_restore;
+    std::vector<wf::point_t> streamed_restores;
+    annotate::worker_t save_worker, rebuild_worker, fill_worker;
+    wf::option_wrapper_t<bool> persist{"annotate/persist"};
     wf::option_wrapper_t<std::string> method{"annotate/method"};
+    wf::option_wrapper_t<std::string> render_mode{"annotate/render_mode"};
     wf::option_wrapper_t<double> line_width{"annotate/line_width"};
+    wf::option_wrapper_t<double> eraser_size{"annotate/eraser_size"};
+    wf::option_wrapper_t<bool> smoothing{"annotate/smoothing"};
+    wf::option_wrapper_t<bool> pressure_sensitivity{"annotate/pressure_sensitivity"};
+    wf::option_wrapper_t<double> decimation{"annotate/decimation"};
+    wf::option_wrapper_t<int> laser_duration{"annotate/laser_duration"};
+    wf::option_wrapper_t<int> fill_tolerance{"annotate/fill_tolerance"};
     wf::option_wrapper_t<bool> shapes_from_center{"annotate/from_center"};
     wf::option_wrapper_t<wf::color_t> stroke_color{"annotate/stroke_color"};
     wf::option_wrapper_t<wf::buttonbinding_t> draw_binding{"annotate/draw"};
     wf::option_wrapper_t<wf::activatorbinding_t> clear_binding{"annotate/clear_workspace"};
+    wf::option_wrapper_t<wf::activatorbinding_t> undo_binding{"annotate/undo"};
+    wf::option_wrapper_t<wf::activatorbinding_t> redo_binding{"annotate/redo"};
+    wf::option_wrapper_t<int> history_size{"annotate/history_size"};
 
     public:
     void init() override
@@ -71,11 +299,25 @@ class wayfire_annotate_screen : public wf::plugin_interface_t
         grab_interface->name = "annotate";
         grab_interface->capabilities = wf::CAPABILITY_MANAGE_COMPOSITOR;
 
+        unpack_row_length = gl_supports_unpack_row_length();
+
+        OpenGL::render_begin();
+        stroke_program.compile(stroke_vertex_shader, stroke_fragment_shader);
+        preview_program.compile(preview_vertex_shader, preview_fragment_shader);
+        laser_program.compile(laser_vertex_shader, laser_fragment_shader);
+        OpenGL::render_end();
+
         auto wsize = output->workspace->get_workspace_grid_size();
+        auto og    = output->get_relative_geometry();
         overlays.resize(wsize.width);
         for (int x = 0; x < wsize.width; x++)
         {
             overlays[x].resize(wsize.height);
+            for (auto& ol : overlays[x])
+            {
+                ol.width  = og.width;
+                ol.height = og.height;
+            }
         }
 
         grab_interface->callbacks.pointer.motion = [=] (int x, int y)
@@ -92,442 +334,1650 @@ class wayfire_annotate_screen : public wf::plugin_interface_t
         };
 
         output->connect_signal("output-configuration-changed", &output_config_changed);
+        wf::get_core().connect_signal("tablet_axis", &on_tablet_axis);
         output->connect_signal("viewport-changed", &viewport_changed);
         method.set_callback(method_changed);
+        persist.set_callback(persist_changed);
+        render_mode.set_callback(render_mode_changed);
+        history_size.set_callback(history_size_changed);
         output->add_button(draw_binding, &draw_begin);
         output->add_activator(clear_binding, &clear_workspace);
+        output->add_activator(undo_binding, &undo);
+        output->add_activator(redo_binding, &redo);
         method_changed();
+        history_size_changed();
+
+        if (!save_worker.init(wf::get_core().ev_loop) ||
+            !rebuild_worker.init(wf::get_core().ev_loop) ||
+            !fill_worker.init(wf::get_core().ev_loop))
+        {
+            LOGE("eventfd() failed: ", std::strerror(errno));
+        }
+
+        find_saved_overlays();
     }
 
-    wf::config::option_base_t::updated_callback_t method_changed = [=] ()
+    /* Logs are only loaded when their workspace is first shown */
+    void find_saved_overlays()
     {
-        if (std::string(method) == "draw")
+        if (!persist)
         {
-            draw_method = ANNOTATE_METHOD_DRAW;
+            return;
         }
-        else if (std::string(method) == "line")
+
+        bool found = false;
+        auto wsize = output->workspace->get_workspace_grid_size();
+        for (int x = 0; x < wsize.width; x++)
+        {
+            for (int y = 0; y < wsize.height; y++)
+            {
+                auto& ol = overlays[x][y];
+                if (ol.log_checked)
+                {
+                    continue;
+                }
+
+                ol.log_checked     = true;
+                ol.restore_pending = access(store_path(x, y).c_str(), R_OK) == 0;
+                found |= ol.restore_pending;
+            }
+        }
+
+        if (found)
         {
-            draw_method = ANNOTATE_METHOD_LINE;
+            restore(output->workspace->get_current_workspace());
+            connect_ws_stream_post();
         }
-        else if (std::string(method) == "rectangle")
+    }
+
+    /*
+     * Turning persistence on loads the logs saved before, under what was
+     * drawn meanwhile. Workspaces whose log was loaded earlier are saved
+     * as they are now, since changes were not written while it was off.
+     */
+    wf::config::option_base_t::updated_callback_t persist_changed = [=] ()
+    {
+        if (!persist)
         {
-            draw_method = ANNOTATE_METHOD_RECTANGLE;
+            return;
         }
-        else if (std::string(method) == "circle")
+
+        auto wsize = output->workspace->get_workspace_grid_size();
+        for (int x = 0; x < wsize.width; x++)
+        {
+            for (int y = 0; y < wsize.height; y++)
+            {
+                auto& ol = overlays[x][y];
+                if (ol.log_checked || !ol.strokes.empty())
+                {
+                    schedule_save(ol);
+                }
+            }
+        }
+
+        find_saved_overlays();
+    };
+
+    std::string store_directory()
+    {
+        const char *data_home = getenv("XDG_DATA_HOME");
+        if (data_home && *data_home)
         {
-            draw_method = ANNOTATE_METHOD_CIRCLE;
+            return std::string(data_home) + "/wayfire/annotate";
         }
-        else
+
+        const char *home = getenv("HOME");
+        return std::string(home ? home : "/tmp") + "/.local/share/wayfire/annotate";
+    }
+
+    std::string store_path(int x, int y)
+    {
+        return store_directory() + "/" + output->to_string() + "_" +
+               std::to_string(x) + "_" + std::to_string(y);
+    }
+
+    /* Load a pending log. The canvas is rasterized on the worker, the
+     * strokes are drawn as triangles until it is done. */
+    void restore(wf::point_t ws)
+    {
+        auto& ol = overlays[ws.x][ws.y];
+        if (!ol.restore_pending)
+        {
+            return;
+        }
+
+        ol.restore_pending = false;
+
+        uint32_t width, height;
+        std::vector<annotate::stroke_t> strokes;
+        if (!annotate::load_strokes(store_path(ws.x, ws.y), strokes, width, height))
+        {
+            LOGE("Failed to load annotations from ", store_path(ws.x, ws.y));
+            return;
+        }
+
+        auto og  = output->get_relative_geometry();
+        auto fit = fit_transform(width, height, og.width, og.height);
+        for (auto& stroke : strokes)
+        {
+            annotate::transform_stroke(stroke, fit.scale, fit.dx, fit.dy);
+        }
+
+        /* Anything drawn before the log was loaded goes on top */
+        for (auto& stroke : ol.strokes)
+        {
+            strokes.push_back(std::move(stroke));
+        }
+
+        ol.strokes = std::move(strokes);
+        ol.history.touch();
+        ol.vertices_stale = true;
+        ol.needs_rebuild = uses_canvas(ol) && !ol.strokes.empty();
+        rebuild_async();
+        if (ol.dirty)
+        {
+            schedule_save(ol);
+        }
+
+        output->render->damage_whole();
+    }
+
+    /* Workspace streams are rendered mid-frame, so the logs of the
+     * workspaces they show are loaded once the frame is done */
+    void queue_restore(wf::point_t ws)
+    {
+        if (std::find(streamed_restores.begin(), streamed_restores.end(), ws) !=
+            streamed_restores.end())
+        {
+            return;
+        }
+
+        streamed_restores.push_back(ws);
+        idle_restore.run_once([=] ()
         {
-            draw_method = ANNOTATE_METHOD_DRAW;
+            auto queued = std::move(streamed_restores);
+            streamed_restores.clear();
+            for (auto& ws : queued)
+            {
+                restore(ws);
+            }
+        });
+    }
+
+    void schedule_save(anno_ws_overlay& ol)
+    {
+        if (!persist)
+        {
+            return;
+        }
+
+        ol.dirty = true;
+        if (!save_timer.is_connected())
+        {
+            save_timer.set_timeout(SAVE_DELAY, save_timeout);
+        }
+    }
+
+    wf::wl_timer::callback_t save_timeout = [=] ()
+    {
+        save_timer.disconnect();
+        start_save();
+    };
+
+    /* Serialize the changed workspaces, an empty log removes the file */
+    std::vector<std::pair<std::string, std::string>> collect_dirty()
+    {
+        std::vector<std::pair<std::string, std::string>> files;
+        auto wsize = output->workspace->get_workspace_grid_size();
+
+        for (int x = 0; x < wsize.width; x++)
+        {
+            for (int y = 0; y < wsize.height; y++)
+            {
+                auto& ol = overlays[x][y];
+                if (!ol.dirty || ol.restore_pending)
+                {
+                    continue;
+                }
+
+                ol.dirty = false;
+                files.emplace_back(store_path(x, y), ol.strokes.empty() ? "" :
+                    annotate::serialize_strokes(ol.strokes, ol.width, ol.height));
+            }
+        }
+
+        return files;
+    }
+
+    void start_save()
+    {
+        /* Try again later, the dirty workspaces stay dirty */
+        if (!save_worker.ready())
+        {
+            save_timer.set_timeout(SAVE_DELAY, save_timeout);
+            return;
+        }
+
+        auto files = collect_dirty();
+        if (files.empty())
+        {
+            return;
+        }
+
+        auto directory = store_directory();
+        save_worker.run([files = std::move(files), directory] ()
+        {
+            write_files(files, directory);
+        }, nullptr);
+    }
+
+    static void write_files(const std::vector<std::pair<std::string, std::string>>& files,
+        const std::string& directory)
+    {
+        if (files.empty())
+        {
+            return;
+        }
+
+        if (!annotate::make_directories(directory))
+        {
+            LOGE("Failed to create ", directory, ": ", std::strerror(errno));
+        }
+
+        for (auto& file : files)
+        {
+            if (!annotate::write_strokes_file(file.first, file.second))
+            {
+                LOGE("Failed to save annotations to ", file.first, ": ",
+                    std::strerror(errno));
+            }
+        }
+    }
+
+    struct fit_t
+    {
+        float scale, dx, dy;
+    };
+
+    /* Scale uniformly to fit the new size and center, keeping the aspect */
+    static fit_t fit_transform(int from_width, int from_height, int to_width, int to_height)
+    {
+        if ((from_width <= 0) || (from_height <= 0))
+        {
+            return {1, 0, 0};
+        }
+
+        float scale = std::min((float)to_width / from_width,
+            (float)to_height / from_height);
+
+        return {scale, (to_width - from_width * scale) / 2,
+            (to_height - from_height * scale) / 2};
+    }
+
+    /* Move the strokes of a workspace, including its history, into the
+     * current output geometry */
+    void fit_to_output(anno_ws_overlay& ol)
+    {
+        auto og = output->get_relative_geometry();
+        if ((ol.width == og.width) && (ol.height == og.height))
+        {
+            return;
+        }
+
+        /* A log not loaded yet is fitted when it is restored */
+        if (ol.restore_pending)
+        {
+            ol.width  = og.width;
+            ol.height = og.height;
+            return;
+        }
+
+        auto fit = fit_transform(ol.width, ol.height, og.width, og.height);
+        auto transform = [&] (annotate::stroke_t& stroke)
+        {
+            annotate::transform_stroke(stroke, fit.scale, fit.dx, fit.dy);
+        };
+
+        std::for_each(ol.strokes.begin(), ol.strokes.end(), transform);
+        ol.history.for_each_stroke(transform);
+        ol.vertices_stale = true;
+        ol.width  = og.width;
+        ol.height = og.height;
+        ol.needs_rebuild = uses_canvas(ol) && !ol.strokes.empty();
+        if (persist)
+        {
+            ol.dirty = true;
+        }
+    }
+
+    /* Whether the canvas can be drawn on directly. While it is being
+     * rebuilt, changes are picked up by another rebuild instead. */
+    bool canvas_usable(anno_ws_overlay& ol)
+    {
+        if (!uses_canvas(ol))
+        {
+            return false;
+        }
+
+        if (ol.rebuilding || ol.needs_rebuild)
+        {
+            ol.needs_rebuild = true;
+            rebuild_async();
+            return false;
         }
+
+        return true;
+    }
+
+    bool canvas_current(anno_ws_overlay& ol)
+    {
+        return uses_canvas(ol) && !ol.rebuilding && !ol.needs_rebuild;
+    }
+
+    struct rebuild_job_t
+    {
+        wf::point_t ws;
+        /* Of the history when the strokes were copied */
+        uint64_t generation;
+        std::vector<annotate::stroke_t> strokes;
+        annotate::canvas_t canvas;
     };
 
-    anno_ws_overlay& get_current_overlay()
+    /* Rasterize every workspace that needs it on the worker */
+    void rebuild_async()
+    {
+        if (!rebuild_worker.ready())
+        {
+            return;
+        }
+
+        auto og    = output->get_relative_geometry();
+        auto jobs  = std::make_shared<std::vector<rebuild_job_t>>();
+        auto wsize = output->workspace->get_workspace_grid_size();
+        for (int x = 0; x < wsize.width; x++)
+        {
+            for (int y = 0; y < wsize.height; y++)
+            {
+                auto& ol = overlays[x][y];
+                if (!ol.needs_rebuild)
+                {
+                    continue;
+                }
+
+                ol.needs_rebuild = false;
+                ol.rebuilding    = true;
+                jobs->push_back({{x, y}, ol.history.generation(), ol.strokes, {}});
+            }
+        }
+
+        if (jobs->empty())
+        {
+            return;
+        }
+
+        rebuild_worker.run([jobs, og] ()
+        {
+            for (auto& job : *jobs)
+            {
+                job.canvas.resize(og.width, og.height);
+                for (auto& stroke : job.strokes)
+                {
+                    annotate::paint_stroke(job.canvas, stroke);
+                }
+            }
+        }, [=] ()
+        {
+            rebuild_done(*jobs);
+        });
+    }
+
+    void rebuild_done(std::vector<rebuild_job_t>& jobs)
+    {
+        auto og = output->get_relative_geometry();
+        for (auto& job : jobs)
+        {
+            auto& ol = overlays[job.ws.x][job.ws.y];
+            ol.rebuilding = false;
+            /* The strokes were changed or cleared meanwhile */
+            if (!uses_canvas(ol) || ol.needs_rebuild ||
+                (job.generation != ol.history.generation()) ||
+                (job.canvas.get_width() != og.width) ||
+                (job.canvas.get_height() != og.height))
+            {
+                ol.needs_rebuild = uses_canvas(ol);
+                continue;
+            }
+
+            overlay_destroy(ol.canvas);
+            ol.canvas = std::move(job.canvas);
+            ol.canvas.unpack_row_length = unpack_row_length;
+            overlay_upload(ol.canvas);
+        }
+
+        output->render->damage_whole();
+        rebuild_async();
+    }
+
+    wf::config::option_base_t::updated_callback_t method_changed = [=] ()
+    {
+        if (std::string(method) == "draw")
+        {
+            draw_method = annotate::ANNOTATE_METHOD_DRAW;
+        }
+        else if (std::string(method) == "line")
+        {
+            draw_method = annotate::ANNOTATE_METHOD_LINE;
+        }
+        else if (std::string(method) == "rectangle")
+        {
+            draw_method = annotate::ANNOTATE_METHOD_RECTANGLE;
+        }
+        else if (std::string(method) == "circle")
+        {
+            draw_method = annotate::ANNOTATE_METHOD_CIRCLE;
+        }
+        else if (std::string(method) == "erase")
+        {
+            draw_method = annotate::ANNOTATE_METHOD_ERASE;
+        }
+        else if (std::string(method) == "fill")
+        {
+            draw_method = annotate::ANNOTATE_METHOD_FILL;
+        }
+        else if (std::string(method) == "laser")
+        {
+            draw_method = annotate::ANNOTATE_METHOD_LASER;
+        }
+        else
+        {
+            draw_method = annotate::ANNOTATE_METHOD_DRAW;
+        }
+    };
+
+    bool raster_mode()
+    {
+        return std::string(render_mode) != "vector";
+    }
+
+    static bool has_erase(const anno_ws_overlay& ol)
+    {
+        return std::any_of(ol.strokes.begin(), ol.strokes.end(),
+            [] (const annotate::stroke_t& stroke)
+        {
+            return stroke.method == annotate::ANNOTATE_METHOD_ERASE;
+        });
+    }
+
+    /* Erasing can't be done with triangles, so a workspace with erase
+     * strokes is rasterized in vector mode as well */
+    bool uses_canvas(const anno_ws_overlay& ol)
+    {
+        return raster_mode() || has_erase(ol);
+    }
+
+    wf::config::option_base_t::updated_callback_t render_mode_changed = [=] ()
+    {
+        auto wsize = output->workspace->get_workspace_grid_size();
+        for (int x = 0; x < wsize.width; x++)
+        {
+            for (int y = 0; y < wsize.height; y++)
+            {
+                rebuild_overlay(overlays[x][y]);
+            }
+        }
+
+        output->render->damage_whole();
+    };
+
+    /* Bring the canvas or the tessellation in line with the stroke log */
+    void rebuild_overlay(anno_ws_overlay& ol)
+    {
+        if (ol.rebuilding)
+        {
+            ol.needs_rebuild = uses_canvas(ol);
+            return;
+        }
+
+        ol.needs_rebuild = false;
+        overlay_destroy(ol.canvas);
+        for (auto& stroke : ol.strokes)
+        {
+            stroke.triangles.clear();
+            stroke.tessellated = 0;
+        }
+
+        ol.vertices_stale = true;
+        if (!uses_canvas(ol) || ol.strokes.empty())
+        {
+            return;
+        }
+
+        cairo_init(ol.canvas);
+        for (auto& stroke : ol.strokes)
+        {
+            annotate::paint_stroke(ol.canvas, stroke);
+        }
+
+        overlay_upload(ol.canvas);
+    }
+
+    /* The budget is per workspace, the option is in KiB */
+    wf::config::option_base_t::updated_callback_t history_size_changed = [=] ()
+    {
+        auto wsize = output->workspace->get_workspace_grid_size();
+        for (int x = 0; x < wsize.width; x++)
+        {
+            for (int y = 0; y < wsize.height; y++)
+            {
+                overlays[x][y].history.set_budget(
+                    (size_t)std::max(int(history_size), 0) * 1024);
+            }
+        }
+    };
+
+    anno_ws_overlay& get_current_overlay()
+    {
+        auto ws = output->workspace->get_current_workspace();
+        return overlays[ws.x][ws.y];
+    }
+
+    wf::signal_connection_t viewport_changed{[this] (wf::signal_data_t *data)
+    {
+        /* The trail stays with the pointer, not with the workspace */
+        laser.clear();
+        restore(output->workspace->get_current_workspace());
+        schedule_evict();
+        output->render->damage_whole();
+    }};
+
+    void schedule_evict()
+    {
+        if (!evict_timer.is_connected())
+        {
+            evict_timer.set_timeout(EVICT_DELAY, evict_timeout);
+        }
+    }
+
+    /*
+     * Workspaces that were not streamed for a while, by expo or cube
+     * for example, have their tiles packed into CPU memory and their
+     * textures freed. They are unpacked when they are shown again.
+     */
+    wf::wl_timer::callback_t evict_timeout = [=] ()
+    {
+        evict_timer.disconnect();
+
+        auto now     = wf::get_current_time();
+        auto current = output->workspace->get_current_workspace();
+        auto wsize   = output->workspace->get_workspace_grid_size();
+        bool pending = false;
+
+        for (int x = 0; x < wsize.width; x++)
+        {
+            for (int y = 0; y < wsize.height; y++)
+            {
+                auto& ol = overlays[x][y];
+                if ((wf::point_t{x, y} == current) || ol.canvas.is_packed() ||
+                    ol.canvas.empty() || ol.rebuilding)
+                {
+                    continue;
+                }
+
+                if (now - ol.last_shown < EVICT_DELAY)
+                {
+                    pending = true;
+                    continue;
+                }
+
+                OpenGL::render_begin();
+                ol.canvas.pack();
+                OpenGL::render_end();
+            }
+        }
+
+        if (pending)
+        {
+            schedule_evict();
+        }
+    };
+
+    wf::pointf_t to_local(wf::pointf_t point)
+    {
+        auto og = output->get_layout_geometry();
+        return {point.x - og.x, point.y - og.y};
+    }
+
+    annotate::stroke_t make_stroke(annotate::annotate_draw_method method)
+    {
+        annotate::stroke_t stroke;
+        wf::color_t color = stroke_color;
+
+        stroke.method = method;
+        stroke.r     = color.r;
+        stroke.g     = color.g;
+        stroke.b     = color.b;
+        /* Triangles of a stroke overlap, so in vector mode a translucent
+         * stroke would be blended twice where they do */
+        stroke.a     = raster_mode() ? color.a : 1.0;
+        stroke.width = method == annotate::ANNOTATE_METHOD_ERASE ? eraser_size : line_width;
+
+        return stroke;
+    }
+
+    /* The shape from the grab point to the given point */
+    annotate::stroke_t make_shape(wf::pointf_t to)
+    {
+        auto stroke = make_stroke(draw_method);
+        auto from   = to_local(grab_point);
+        to = to_local(to);
+
+        switch (draw_method)
+        {
+            case annotate::ANNOTATE_METHOD_LINE:
+                stroke.points = {{(float)from.x, (float)from.y}, {(float)to.x, (float)to.y}};
+                break;
+            case annotate::ANNOTATE_METHOD_RECTANGLE:
+            {
+                double x, y, w, h;
+                w = fabs(from.x - to.x);
+                h = fabs(from.y - to.y);
+
+                if (shapes_from_center)
+                {
+                    x = from.x - w;
+                    y = from.y - h;
+                    w *= 2;
+                    h *= 2;
+                }
+                else
+                {
+                    x = std::min(from.x, to.x);
+                    y = std::min(from.y, to.y);
+                }
+
+                stroke.points = {{(float)x, (float)y}, {(float)(x + w), (float)(y + h)}};
+                break;
+            }
+            case annotate::ANNOTATE_METHOD_CIRCLE:
+            {
+                auto radius = glm::distance(glm::vec2(from.x, from.y), glm::vec2(to.x, to.y));
+
+                if (!shapes_from_center)
+                {
+                    radius /= 2;
+                    from.x += (to.x - from.x) / 2;
+                    from.y += (to.y - from.y) / 2;
+                }
+
+                stroke.points = {{(float)from.x, (float)from.y},
+                    {(float)from.x + radius, (float)from.y}};
+                break;
+            }
+            default:
+                break;
+        }
+
+        return stroke;
+    }
+
+    wf::button_callback draw_begin = [=] (uint32_t b, int x, int y)
+    {
+        grab_point = last_cursor = wf::get_core().get_cursor_position();
+        button = b;
+
+        if (!grab())
+        {
+            return false;
+        }
+
+        if ((draw_method == annotate::ANNOTATE_METHOD_DRAW) ||
+            (draw_method == annotate::ANNOTATE_METHOD_ERASE))
+        {
+            auto& ol = get_current_overlay();
+            bool had_canvas = uses_canvas(ol);
+
+            tablet_pressure = -1;
+            motion_filter.reset(wf::get_current_time());
+            motion_filter.filter({(float)grab_point.x, (float)grab_point.y},
+                wf::get_current_time());
+
+            auto stroke = make_stroke(draw_method);
+            auto point  = to_local(grab_point);
+            stroke.points.push_back({(float)point.x, (float)point.y});
+            ol.strokes.push_back(std::move(stroke));
+            ol.history.record_stroke();
+
+            /* First erase stroke in vector mode, rasterize what is there */
+            if (!had_canvas)
+            {
+                ol.needs_rebuild = true;
+                rebuild_async();
+            }
+        } else if (draw_method == annotate::ANNOTATE_METHOD_LASER)
+        {
+            auto point = to_local(grab_point);
+            laser.begin({(float)point.x, (float)point.y}, wf::get_current_time());
+        } else if (draw_method == annotate::ANNOTATE_METHOD_FILL)
+        {
+            fill_at(get_current_overlay(), grab_point);
+        }
+
+        return true;
+    };
+
+    void draw_end()
+    {
+        flush_motion();
+        disconnect_motion_hook();
+
+        auto& ol = get_current_overlay();
+
+        ungrab();
+
+        switch (draw_method)
+        {
+            case annotate::ANNOTATE_METHOD_DRAW:
+            case annotate::ANNOTATE_METHOD_ERASE:
+                finish_freehand(ol);
+                break;
+            case annotate::ANNOTATE_METHOD_LINE:
+                commit_stroke(ol, make_shape(wf::get_core().get_cursor_position()));
+                break;
+            case annotate::ANNOTATE_METHOD_RECTANGLE:
+            case annotate::ANNOTATE_METHOD_CIRCLE:
+                commit_stroke(ol, make_shape(last_cursor));
+                break;
+            default:
+                break;
+	}
+
+        preview_active = false;
+        if (draw_method != annotate::ANNOTATE_METHOD_LASER)
+        {
+            schedule_save(ol);
+        }
+    }
+
+    /*
+     * Axis events are emitted before the tool moves the cursor, so the
+     * pressure is known by the time the motion reaches the grab.
+     */
+    wf::signal_callback_t on_tablet_axis = [=] (wf::signal_data_t *data)
+    {
+        auto ev = static_cast<
+            wf::input_event_signal<wlr_event_tablet_tool_axis>*>(data)->event;
+
+        if (ev->updated_axes & WLR_TABLET_TOOL_AXIS_PRESSURE)
+        {
+            tablet_pressure = ev->pressure;
+        }
+    };
+
+    /*
+     * Motion events can arrive much faster than the output refreshes,
+     * so they are only queued here and drawn once per frame.
+     */
+    void pointer_moved()
+    {
+        auto cursor = wf::get_core().get_cursor_position();
+        /* The laser follows the pointer as it is, filtering only adds lag */
+        if ((draw_method == annotate::ANNOTATE_METHOD_DRAW) && smoothing)
+        {
+            auto p = motion_filter.filter({(float)cursor.x, (float)cursor.y},
+                wf::get_current_time());
+            cursor = {p.x, p.y};
+        }
+
+        pending_motion.push_back(cursor);
+        pending_pressure.push_back(pressure_sensitivity ? tablet_pressure : -1);
+        connect_motion_hook();
+        output->render->schedule_redraw();
+    }
+
+    wf::effect_hook_t motion_hook = [=] ()
+    {
+        flush_motion();
+    };
+
+    void flush_motion()
+    {
+        if (pending_motion.empty())
+        {
+            return;
+        }
+
+        auto& ol = get_current_overlay();
+        auto current_cursor = pending_motion.back();
+
+        switch (draw_method)
+        {
+            case annotate::ANNOTATE_METHOD_DRAW:
+            case annotate::ANNOTATE_METHOD_ERASE:
+                draw_freehand(ol, pending_motion, pending_pressure);
+                break;
+            case annotate::ANNOTATE_METHOD_LINE:
+            case annotate::ANNOTATE_METHOD_RECTANGLE:
+            case annotate::ANNOTATE_METHOD_CIRCLE:
+                /* Only the latest position matters for a shape */
+                draw_preview(make_shape(current_cursor));
+                break;
+            case annotate::ANNOTATE_METHOD_LASER:
+                draw_laser(pending_motion);
+                break;
+            default:
+                break;
+        }
+
+        pending_motion.clear();
+        pending_pressure.clear();
+        last_cursor = current_cursor;
+
+        connect_ws_stream_post();
+    }
+
+    void connect_motion_hook()
+    {
+        if (motion_hook_set)
+            return;
+
+        output->render->add_effect(&motion_hook, wf::OUTPUT_EFFECT_PRE);
+        motion_hook_set = true;
+    }
+
+    void disconnect_motion_hook()
+    {
+        if (!motion_hook_set)
+            return;
+
+        output->render->rem_effect(&motion_hook);
+        motion_hook_set = false;
+    }
+
+    /* Extend the laser trail, the hook below fades and expires it */
+    void draw_laser(const std::vector<wf::pointf_t>& to)
+    {
+        auto now = wf::get_current_time();
+        annotate::rect_t bbox = {0, 0, 0, 0};
+        for (auto& p : to)
+        {
+            auto point = to_local(p);
+            bbox = annotate::rect_union(bbox,
+                laser.add({(float)point.x, (float)point.y}, line_width, now));
+        }
+
+        if (laser.empty())
+        {
+            return;
+        }
+
+        output->render->damage(to_box(bbox));
+        connect_laser_hook();
+    }
+
+    /*
+     * Runs every frame while the trail is visible. Only the live
+     * segments are damaged, the shader fades them from their age.
+     */
+    wf::effect_hook_t laser_hook = [=] ()
+    {
+        auto removed = laser.expire(wf::get_current_time(),
+            std::max(int(laser_duration), 1));
+        if (!removed.empty())
+        {
+            output->render->damage(to_box(removed));
+        }
+
+        if (laser.empty())
+        {
+            disconnect_laser_hook();
+            deactivate_check();
+            return;
+        }
+
+        output->render->damage(to_box(laser.bounds()));
+        output->render->schedule_redraw();
+    };
+
+    void connect_laser_hook()
+    {
+        connect_ws_stream_post();
+        if (laser_hook_set)
+            return;
+
+        output->render->add_effect(&laser_hook, wf::OUTPUT_EFFECT_PRE);
+        laser_hook_set = true;
+    }
+
+    void disconnect_laser_hook()
+    {
+        if (!laser_hook_set)
+            return;
+
+        output->render->rem_effect(&laser_hook);
+        laser_hook_set = false;
+    }
+
+    void deactivate_check()
+    {
+        bool all_workspaces_clear = laser.empty();
+        auto wsize = output->workspace->get_workspace_grid_size();
+
+        for (int x = 0; x < wsize.width; x++)
+        {
+            for (int y = 0; y < wsize.height; y++)
+            {
+                auto& ol = overlays[x][y];
+                if (!ol.strokes.empty() || ol.restore_pending)
+                {
+                    all_workspaces_clear = false;
+                    x = wsize.width;
+                    break;
+                }
+            }
+        }
+
+        if (all_workspaces_clear)
+            disconnect_ws_stream_post();
+    }
+
+    void overlay_destroy(annotate::canvas_t& ol)
+    {
+        OpenGL::render_begin();
+        ol.clear();
+        OpenGL::render_end();
+    }
+
+    void clear()
+    {
+        auto& ol = get_current_overlay();
+
+        ol.history.record_clear(ol.strokes);
+        ol.vertices_stale = true;
+        overlay_destroy(ol.canvas);
+        schedule_save(ol);
+        deactivate_check();
+
+        output->render->damage_whole();
+    }
+
+    wf::signal_connection_t output_config_changed{[this] (wf::signal_data_t *data)
+    {
+        wf::output_configuration_changed_signal *signal =
+            static_cast<wf::output_configuration_changed_signal*>(data);
+
+        if (!signal->changed_fields)
+        {
+            return;
+        }
+
+        if (signal->changed_fields & wf::OUTPUT_SOURCE_CHANGE)
+        {
+            return;
+        }
+
+        auto wsize = output->workspace->get_workspace_grid_size();
+        for (int x = 0; x < wsize.width; x++)
+        {
+            for (int y = 0; y < wsize.height; y++)
+            {
+                fit_to_output(overlays[x][y]);
+            }
+        }
+
+        if (persist && !save_timer.is_connected())
+        {
+            save_timer.set_timeout(SAVE_DELAY, save_timeout);
+        }
+
+        rebuild_async();
+        output->render->damage_whole();
+    }};
+
+    wf::activator_callback clear_workspace = [=] (wf::activator_source_t, uint32_t)
+    {
+        clear();
+        return true;
+    };
+
+    wf::activator_callback undo = [=] (wf::activator_source_t, uint32_t)
+    {
+        if (output->is_plugin_active(grab_interface->name))
+        {
+            return false;
+        }
+
+        auto& ol = get_current_overlay();
+        repaint(ol, ol.history.undo(ol.strokes));
+        schedule_save(ol);
+        return true;
+    };
+
+    wf::activator_callback redo = [=] (wf::activator_source_t, uint32_t)
+    {
+        if (output->is_plugin_active(grab_interface->name))
+        {
+            return false;
+        }
+
+        auto& ol = get_current_overlay();
+        repaint(ol, ol.history.redo(ol.strokes));
+        schedule_save(ol);
+        return true;
+    };
+
+    /* Redraw the strokes inside box after some were added or removed */
+    void repaint(anno_ws_overlay& ol, annotate::rect_t box)
+    {
+        ol.vertices_stale = true;
+        if (box.empty())
+        {
+            return;
+        }
+
+        if (canvas_usable(ol))
+        {
+            cairo_init(ol.canvas);
+            ol.canvas.erase(box);
+            for (auto& stroke : ol.strokes)
+            {
+                annotate::paint_stroke_clipped(ol.canvas, stroke, box);
+            }
+
+            overlay_upload(ol.canvas);
+            release_empty(ol, box);
+        } else if (!uses_canvas(ol))
+        {
+            overlay_destroy(ol.canvas);
+        }
+
+        if (ol.strokes.empty())
+        {
+            deactivate_check();
+        } else
+        {
+            connect_ws_stream_post();
+        }
+
+        output->render->damage(to_box(box));
+    }
+
+    /* Give back the memory of tiles that were erased completely */
+    void release_empty(anno_ws_overlay& ol, annotate::rect_t box)
+    {
+        if (!canvas_current(ol))
+        {
+            return;
+        }
+
+        OpenGL::render_begin();
+        ol.canvas.release_empty(box);
+        OpenGL::render_end();
+    }
+
+    /* Tiles are allocated on first draw, this only sets the canvas size */
+    void cairo_init(annotate::canvas_t& ol)
+    {
+        auto og = output->get_relative_geometry();
+
+        ol.unpack_row_length = unpack_row_length;
+        OpenGL::render_begin();
+        ol.resize(og.width, og.height);
+        OpenGL::render_end();
+    }
+
+    /* Upload the parts of the tiles that were drawn on */
+    void overlay_upload(annotate::canvas_t& ol)
+    {
+        OpenGL::render_begin();
+        ol.upload();
+        OpenGL::render_end();
+    }
+
+    bool gl_supports_unpack_row_length()
     {
-        auto ws = output->workspace->get_current_workspace();
-        return overlays[ws.x][ws.y];
+        OpenGL::render_begin();
+        std::string version    = (const char*)glGetString(GL_VERSION);
+        std::string extensions = (const char*)glGetString(GL_EXTENSIONS);
+        OpenGL::render_end();
+
+        return version.find("OpenGL ES 3") != std::string::npos ||
+               extensions.find("GL_EXT_unpack_subimage") != std::string::npos;
     }
 
-    wf::signal_connection_t viewport_changed{[this] (wf::signal_data_t *data)
+    wlr_box to_box(annotate::rect_t rect)
     {
-        output->render->damage_whole();
-    }};
+        return {rect.x, rect.y, rect.width, rect.height};
+    }
 
-    wf::button_callback draw_begin = [=] (uint32_t b, int x, int y)
+    /* Extend the current stroke with a polyline, uploaded and damaged once */
+    void draw_freehand(anno_ws_overlay& ol, const std::vector<wf::pointf_t>& to,
+        const std::vector<float>& pressures)
     {
-        grab_point = last_cursor = wf::get_core().get_cursor_position();
-        button = b;
-
-        grab();
+        if (ol.strokes.empty())
+        {
+            return;
+        }
 
-        return true;
-    };
+        auto& stroke = ol.strokes.back();
+        size_t first = stroke.points.size();
 
-    void draw_end()
-    {
-        auto& ol = get_current_overlay();
+        for (size_t i = 0; i < to.size(); i++)
+        {
+            auto point = to_local(to[i]);
+            stroke.points.push_back({(float)point.x, (float)point.y});
+            add_pressure(stroke, pressures[i]);
+        }
 
-        overlay_destroy(shape_overlay);
-        ungrab();
+        ol.history.touch();
 
-        switch (draw_method)
+        auto bbox = to_box(annotate::stroke_bounds_from(stroke, first));
+        if (canvas_usable(ol))
         {
-            case ANNOTATE_METHOD_LINE:
-                cairo_draw_line(ol, wf::get_core().get_cursor_position());
-                break;
-            case ANNOTATE_METHOD_RECTANGLE:
-                cairo_draw_rectangle(ol, last_cursor);
-                break;
-            case ANNOTATE_METHOD_CIRCLE:
-                cairo_draw_circle(ol, last_cursor);
-                break;
-            default:
-                break;
-	}
+            cairo_init(ol.canvas);
+            annotate::paint_stroke(ol.canvas, stroke, first);
+            overlay_upload(ol.canvas);
+        }
+
+        output->render->damage(bbox);
     }
 
-    void pointer_moved()
+    /*
+     * Once a pressure sample arrives, the stroke gets a width per point.
+     * Points before the first sample take its width, and positions
+     * without a new sample keep the previous one.
+     */
+    void add_pressure(annotate::stroke_t& stroke, float pressure)
     {
-        auto current_cursor = wf::get_core().get_cursor_position();
-        auto& ol = get_current_overlay();
-
-        switch (draw_method)
+        if ((pressure < 0) && stroke.widths.empty())
         {
-            case ANNOTATE_METHOD_DRAW:
-                cairo_draw(ol, last_cursor, current_cursor);
-                break;
-            case ANNOTATE_METHOD_LINE:
-                cairo_draw_line(shape_overlay, current_cursor);
-                break;
-            case ANNOTATE_METHOD_RECTANGLE:
-                cairo_draw_rectangle(shape_overlay, current_cursor);
-                break;
-            case ANNOTATE_METHOD_CIRCLE:
-                cairo_draw_circle(shape_overlay, current_cursor);
-                break;
-            default:
-                return;
-	}
-
-        last_cursor = current_cursor;
+            return;
+        }
 
-        connect_ws_stream_post();
+        float width = pressure < 0 ? stroke.widths.back() :
+            stroke.width * std::clamp(pressure, 0.1f, 1.0f);
+        stroke.widths.resize(stroke.points.size(), width);
     }
 
-    void deactivate_check()
+    /* Decimate and smooth the finished stroke, then redraw what changed */
+    void finish_freehand(anno_ws_overlay& ol)
     {
-        bool all_workspaces_clear = true;
-        auto wsize = output->workspace->get_workspace_grid_size();
+        if (ol.strokes.empty())
+        {
+            return;
+        }
 
-        for (int x = 0; x < wsize.width; x++)
+        auto& stroke = ol.strokes.back();
+        auto old_bounds = annotate::stroke_bounds(stroke);
+        size_t count    = stroke.points.size();
+
+        if (smoothing)
         {
-            for (int y = 0; y < wsize.height; y++)
+            auto kept = annotate::decimate_indices(stroke.points, decimation);
+            stroke.points = annotate::select(stroke.points, kept);
+            if (!stroke.widths.empty())
             {
-                auto& ol = overlays[x][y];
-                if (ol.cr)
-                {
-                    all_workspaces_clear = false;
-                    x = wsize.width;
-                    break;
-                }
+                stroke.widths = annotate::select(stroke.widths, kept);
             }
         }
 
-        if (all_workspaces_clear)
-            disconnect_ws_stream_post();
-    }
+        /* The spline has no width to follow, pressure strokes stay polylines */
+        stroke.smooth = smoothing && (stroke.method == annotate::ANNOTATE_METHOD_DRAW) &&
+            stroke.widths.empty() && (stroke.points.size() > 2);
+        /* Widths may have been assigned after the first points were drawn */
+        if (!stroke.smooth && stroke.widths.empty() && (stroke.points.size() == count))
+        {
+            if (stroke.method == annotate::ANNOTATE_METHOD_ERASE)
+            {
+                release_empty(ol, old_bounds);
+            }
 
-    void overlay_clear(anno_ws_overlay& ol)
-    {
-        if (!ol.cr)
             return;
+        }
 
-        cairo_clear(ol.cr);
+        stroke.triangles.clear();
+        stroke.tessellated = 0;
+        ol.history.touch();
+        repaint(ol, annotate::rect_union(old_bounds, annotate::stroke_bounds(stroke)));
     }
 
-    void overlay_destroy(anno_ws_overlay& ol)
+    bool should_damage_last()
     {
-        if (!ol.cr)
-            return;
-
-        ol.texture.reset();
-        cairo_surface_destroy(ol.cairo_surface);
-        cairo_destroy(ol.cr);
-        ol.cr = nullptr;
+        return preview_active;
     }
 
-    void clear()
+    void draw_preview(annotate::stroke_t stroke)
     {
-        auto& ol = get_current_overlay();
+        bool damage_last_bbox = should_damage_last();
+        auto bbox = to_box(annotate::stroke_bounds(stroke));
 
-        overlay_destroy(ol);
-        deactivate_check();
+        preview = std::move(stroke);
+        preview_active = true;
 
-        output->render->damage_whole();
+        output->render->damage(bbox);
+        if (damage_last_bbox)
+        {
+            output->render->damage(last_bbox);
+        }
+        last_bbox = bbox;
     }
 
-    wf::signal_connection_t output_config_changed{[this] (wf::signal_data_t *data)
+    void commit_stroke(anno_ws_overlay& ol, annotate::stroke_t stroke)
     {
-        wf::output_configuration_changed_signal *signal =
-            static_cast<wf::output_configuration_changed_signal*>(data);
+        auto bbox = to_box(annotate::stroke_bounds(stroke));
 
-        if (!signal->changed_fields)
+        if (canvas_usable(ol))
         {
-            return;
+            cairo_init(ol.canvas);
+            annotate::paint_stroke(ol.canvas, stroke);
+            overlay_upload(ol.canvas);
         }
 
-        if (signal->changed_fields & wf::OUTPUT_SOURCE_CHANGE)
+        ol.strokes.push_back(std::move(stroke));
+        ol.history.record_stroke();
+
+        output->render->damage(bbox);
+        if (should_damage_last())
         {
-            return;
+            output->render->damage(last_bbox);
         }
+    }
 
-        clear();
-    }};
-
-    wf::activator_callback clear_workspace = [=] (wf::activator_source_t, uint32_t)
+    struct fill_job_t
     {
-        clear();
-        return true;
+        /* Of the history when the strokes were copied */
+        uint64_t generation;
+        std::vector<annotate::stroke_t> strokes;
+        annotate::stroke_t fill;
     };
 
-    void cairo_init(anno_ws_overlay& ol)
+    /*
+     * Fill the area around the point. It is found on the canvas if it is
+     * current. Otherwise the strokes are rasterized once on the worker,
+     * and a click while that runs is dropped, as is the result if the
+     * strokes changed before it was done. The area is recorded as
+     * rectangles, so only their bounds are uploaded.
+     */
+    void fill_at(anno_ws_overlay& ol, wf::pointf_t at)
     {
-        auto og = output->get_relative_geometry();
+        auto point  = to_local(at);
+        auto stroke = make_stroke(annotate::ANNOTATE_METHOD_FILL);
+        int x = std::floor(point.x), y = std::floor(point.y);
+        uint8_t tolerance = std::clamp(int(fill_tolerance), 0, 255);
+        stroke.width = 0;
 
-        if (ol.cr)
+        if (canvas_current(ol))
+        {
+            stroke.points = annotate::flood_fill(ol.canvas, x, y, tolerance);
+            commit_fill(ol, std::move(stroke));
             return;
+        }
 
-        ol.cairo_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, og.width, og.height);
-        ol.cr = cairo_create(ol.cairo_surface);
+        if (!fill_worker.ready())
+        {
+            return;
+        }
 
-        ol.texture = std::make_unique<wf::simple_texture_t> ();
-    }
+        auto og  = output->get_relative_geometry();
+        auto ws  = output->workspace->get_current_workspace();
+        auto job = std::make_shared<fill_job_t>();
+        job->generation = ol.history.generation();
+        job->strokes = ol.strokes;
+        job->fill    = std::move(stroke);
+        fill_worker.run([job, og, x, y, tolerance] ()
+        {
+            annotate::canvas_t canvas;
+            canvas.resize(og.width, og.height);
+            for (auto& stroke : job->strokes)
+            {
+                annotate::paint_stroke(canvas, stroke);
+            }
 
-    void cairo_clear(cairo_t *cr)
-    {
-        cairo_set_source_rgba(cr, 0, 0, 0, 0);
-        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-        cairo_paint(cr);
-    }
+            job->fill.points = annotate::flood_fill(canvas, x, y, tolerance);
+        }, [=] ()
+        {
+            /* The strokes were fitted to a new size meanwhile */
+            auto current = output->get_relative_geometry();
+            if ((current.width != og.width) || (current.height != og.height))
+            {
+                return;
+            }
 
-    /* GLESv2 doesn't support GL_BGRA */
-    void cairo_set_source_rgba_swizzle(cairo_t *cr, double r, double g, double b, double a)
-    {
-        cairo_set_source_rgba(cr, b, g, r, a);
+            auto& ol = overlays[ws.x][ws.y];
+            if (job->generation != ol.history.generation())
+            {
+                return;
+            }
+
+            commit_fill(ol, std::move(job->fill));
+            schedule_save(ol);
+        });
     }
 
-    void cairo_draw(anno_ws_overlay& ol, wf::pointf_t from, wf::pointf_t to)
+    void commit_fill(anno_ws_overlay& ol, annotate::stroke_t stroke)
     {
-        auto og = output->get_layout_geometry();
-
-        from.x -= og.x;
-        from.y -= og.y;
-        to.x -= og.x;
-        to.y -= og.y;
+        if (stroke.points.empty())
+        {
+            return;
+        }
 
-        cairo_init(ol);
-        cairo_t *cr = ol.cr;
+        commit_stroke(ol, std::move(stroke));
+        connect_ws_stream_post();
+    }
 
-        cairo_set_line_width(cr, line_width);
-        cairo_set_source_rgba_swizzle(cr,
-            wf::color_t(stroke_color).r,
-            wf::color_t(stroke_color).g,
-            wf::color_t(stroke_color).b,
-            wf::color_t(stroke_color).a);
-        cairo_move_to(cr, from.x, from.y);
-        cairo_line_to(cr, to.x, to.y);
-        cairo_stroke(cr);
+    void render_overlay(annotate::canvas_t& ol, const wf::framebuffer_t& fb)
+    {
+        auto og = fb.geometry;
 
-        OpenGL::render_begin();
-        cairo_surface_upload_to_texture(ol.cairo_surface, *ol.texture);
-        OpenGL::render_end();
+        ol.for_each_tile([&] (annotate::tile_t& tile, annotate::rect_t box)
+        {
+            if (!tile.tex)
+            {
+                return;
+            }
 
-        wlr_box bbox;
-        int padding = line_width + 1;
-        bbox.x = std::min(from.x, to.x) - padding;
-        bbox.y = std::min(from.y, to.y) - padding;
-        bbox.width = abs(from.x - to.x) + padding * 2;
-        bbox.height = abs(from.y - to.y) + padding * 2;
-        output->render->damage(bbox);
+            wlr_box geometry{og.x + box.x, og.y + box.y, box.width, box.height};
+            OpenGL::render_texture(wf::texture_t{tile.tex}, fb, geometry,
+                glm::vec4(1.0), OpenGL::TEXTURE_TRANSFORM_INVERT_Y);
+        });
     }
 
-    bool should_damage_last()
+    /* Position and premultiplied color */
+    static constexpr int STROKE_VERTEX_FLOATS = 6;
+
+    /* Opaque for vector mode, which also draws strokes loaded from a
+     * log or drawn in raster mode without their alpha */
+    static void append_vertices(std::vector<float>& out,
+        const annotate::stroke_t& stroke, size_t from, bool opaque)
     {
-        return shape_overlay.texture && shape_overlay.texture->tex != (uint32_t) -1;
+        float a = opaque ? 1.0f : stroke.a;
+        float r = stroke.r * a, g = stroke.g * a, b = stroke.b * a;
+        for (size_t i = from * 2; i + 1 < stroke.triangles.size(); i += 2)
+        {
+            out.insert(out.end(), {stroke.triangles[i], stroke.triangles[i + 1],
+                r, g, b, a});
+        }
     }
 
-    void cairo_draw_line(anno_ws_overlay& ol, wf::pointf_t to)
+    /* Bring the vertex buffer in line with the strokes. Only the last
+     * stroke can still grow, so new vertices always go at the end. */
+    void update_vertices(anno_ws_overlay& ol)
     {
-        auto og = output->get_layout_geometry();
-        auto from = grab_point;
-
-        from.x -= og.x;
-        from.y -= og.y;
-        to.x -= og.x;
-        to.y -= og.y;
-
-        bool damage_last_bbox = should_damage_last();
-        overlay_clear(shape_overlay);
-
-        cairo_init(ol);
-        cairo_t *cr = ol.cr;
+        for (auto& stroke : ol.strokes)
+        {
+            annotate::tessellate_stroke(stroke);
+        }
 
-        cairo_set_line_width(cr, line_width);
-        cairo_set_source_rgba_swizzle(cr,
-            wf::color_t(stroke_color).r,
-            wf::color_t(stroke_color).g,
-            wf::color_t(stroke_color).b,
-            wf::color_t(stroke_color).a);
-        cairo_move_to(cr, from.x, from.y);
-        cairo_line_to(cr, to.x, to.y);
-        cairo_stroke(cr);
+        if (ol.vertices_stale || (ol.ranges.size() > ol.strokes.size()))
+        {
+            ol.ranges.clear();
+            ol.vbo_used = 0;
+            ol.vertices_stale = false;
+        }
 
-        OpenGL::render_begin();
-        cairo_surface_upload_to_texture(ol.cairo_surface, *ol.texture);
-        OpenGL::render_end();
+        std::vector<float> data;
+        bool opaque = !raster_mode();
+        size_t i = ol.ranges.size();
+        if (i > 0)
+        {
+            auto& range = ol.ranges.back();
+            append_vertices(data, ol.strokes[i - 1], range.count, opaque);
+            range.count  = (GLsizei)(ol.strokes[i - 1].triangles.size() / 2);
+            range.bounds = annotate::stroke_bounds(ol.strokes[i - 1]);
+        }
 
-        wlr_box bbox;
-        int padding = line_width + 1;
-        bbox.x = std::min(from.x, to.x) - padding;
-        bbox.y = std::min(from.y, to.y) - padding;
-        bbox.width = abs(from.x - to.x) + padding * 2;
-        bbox.height = abs(from.y - to.y) + padding * 2;
-        output->render->damage(bbox);
-        if (damage_last_bbox)
+        for (; i < ol.strokes.size(); i++)
         {
-            output->render->damage(last_bbox);
+            GLint first = ol.vbo_used + data.size() / STROKE_VERTEX_FLOATS;
+            append_vertices(data, ol.strokes[i], 0, opaque);
+            ol.ranges.push_back({first, (GLsizei)(ol.strokes[i].triangles.size() / 2),
+                annotate::stroke_bounds(ol.strokes[i])});
         }
-        last_bbox = bbox;
-    }
 
-    void cairo_draw_rectangle(anno_ws_overlay& ol, wf::pointf_t to)
-    {
-        auto og = output->get_layout_geometry();
-        auto from = grab_point;
-        double x, y, w, h;
+        if (data.empty())
+        {
+            return;
+        }
 
-        from.x -= og.x;
-        from.y -= og.y;
-        to.x -= og.x;
-        to.y -= og.y;
+        size_t count  = data.size() / STROKE_VERTEX_FLOATS;
+        size_t stride = STROKE_VERTEX_FLOATS * sizeof(float);
+        if (ol.vbo_used + count > ol.vbo_capacity)
+        {
+            /* The old contents are lost when the buffer grows */
+            if (ol.vbo_used > 0)
+            {
+                ol.vertices_stale = true;
+                update_vertices(ol);
+                return;
+            }
 
-        bool damage_last_bbox = should_damage_last();
-        overlay_clear(shape_overlay);
+            if (!ol.vbo)
+            {
+                GL_CALL(glGenBuffers(1, &ol.vbo));
+            }
 
-        cairo_init(ol);
-        cairo_t *cr = ol.cr;
+            ol.vbo_capacity = std::max<size_t>(count * 2, 1024);
+            GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, ol.vbo));
+            GL_CALL(glBufferData(GL_ARRAY_BUFFER, ol.vbo_capacity * stride,
+                nullptr, GL_DYNAMIC_DRAW));
+        }
 
-        w = fabs(from.x - to.x);
-        h = fabs(from.y - to.y);
+        GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, ol.vbo));
+        GL_CALL(glBufferSubData(GL_ARRAY_BUFFER, ol.vbo_used * stride,
+            data.size() * sizeof(float), data.data()));
+        GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+        ol.vbo_used += count;
+    }
 
-        if (shapes_from_center)
+    /* With a GL context current */
+    void free_vertices(anno_ws_overlay& ol)
+    {
+        if (ol.vbo)
         {
-            x = from.x - w;
-            y = from.y - h;
-            w *= 2;
-            h *= 2;
+            GL_CALL(glDeleteBuffers(1, &ol.vbo));
         }
-        else
+
+        ol.vbo = 0;
+        ol.vbo_capacity = ol.vbo_used = 0;
+        ol.ranges.clear();
+        ol.vertices_stale = true;
+    }
+
+    /*
+     * Draw the strokes as triangles straight into the workspace stream.
+     * For each damaged box, the strokes from the first to the last one
+     * that reach into it are drawn with a single call.
+     */
+    void render_strokes(anno_ws_overlay& ol, const wf::framebuffer_t& fb,
+        const wf::region_t& damage)
+    {
+        update_vertices(ol);
+        if (ol.vbo_used == 0)
         {
-            x = std::min(from.x, to.x);
-            y = std::min(from.y, to.y);
+            return;
         }
 
-        cairo_set_line_width(cr, line_width);
-        cairo_set_source_rgba_swizzle(cr,
-            wf::color_t(stroke_color).r,
-            wf::color_t(stroke_color).g,
-            wf::color_t(stroke_color).b,
-            wf::color_t(stroke_color).a);
-        cairo_rectangle(cr, x, y, w, h);
-        cairo_stroke(cr);
+        auto og = fb.geometry;
+        auto matrix = fb.get_orthographic_projection() *
+            glm::translate(glm::mat4(1.0), glm::vec3(og.x, og.y, 0.0));
+        int stride  = STROKE_VERTEX_FLOATS * sizeof(float);
 
-        OpenGL::render_begin();
-        cairo_surface_upload_to_texture(ol.cairo_surface, *ol.texture);
-        OpenGL::render_end();
+        stroke_program.use(wf::TEXTURE_TYPE_RGBA);
+        stroke_program.uniformMatrix4f("matrix", matrix);
+        GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, ol.vbo));
+        stroke_program.attrib_pointer("position", 2, stride, (void*)0);
+        stroke_program.attrib_pointer("color", 4, stride, (void*)(2 * sizeof(float)));
+        GL_CALL(glEnable(GL_BLEND));
+        GL_CALL(glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA));
 
-        wlr_box bbox;
-        int padding = line_width + 1;
-        bbox.x = x - padding;
-        bbox.y = y - padding;
-        bbox.width = w + padding * 2;
-        bbox.height = h + padding * 2;
-        output->render->damage(bbox);
-        if (damage_last_bbox)
+        auto reaches = [] (annotate::rect_t box)
         {
-            output->render->damage(last_bbox);
-        }
-        last_bbox = bbox;
-    }
-
-    void cairo_draw_circle(anno_ws_overlay& ol, wf::pointf_t to)
-    {
-        auto og = output->get_layout_geometry();
-        auto from = grab_point;
+            return [box] (const stroke_range_t& range)
+            {
+                return (range.count > 0) &&
+                       !annotate::rect_intersection(range.bounds, box).empty();
+            };
+        };
 
-        from.x -= og.x;
-        from.y -= og.y;
-        to.x -= og.x;
-        to.y -= og.y;
+        for (auto& box : damage)
+        {
+            auto scissor = wlr_box_from_pixman_box(box);
+            annotate::rect_t local = {scissor.x - og.x, scissor.y - og.y,
+                scissor.width, scissor.height};
+            auto first = std::find_if(ol.ranges.begin(), ol.ranges.end(), reaches(local));
+            if (first == ol.ranges.end())
+            {
+                continue;
+            }
 
-        bool damage_last_bbox = should_damage_last();
-        overlay_clear(shape_overlay);
+            auto last = std::find_if(ol.ranges.rbegin(), ol.ranges.rend(), reaches(local));
+            fb.logic_scissor(scissor);
+            GL_CALL(glDrawArrays(GL_TRIANGLES, first->first,
+                last->first + last->count - first->first));
+        }
 
-        cairo_init(ol);
-        cairo_t *cr = ol.cr;
+        GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, 0));
+        stroke_program.deactivate();
+    }
 
-        auto radius = glm::distance(glm::vec2(from.x, from.y), glm::vec2(to.x, to.y));
+    /* A single quad over the preview bounds, the shader does the rest */
+    void render_preview(const wf::framebuffer_t& fb, const wf::region_t& damage)
+    {
+        auto og  = fb.geometry;
+        auto box = annotate::stroke_bounds(preview);
+        auto matrix = fb.get_orthographic_projection() *
+            glm::translate(glm::mat4(1.0), glm::vec3(og.x, og.y, 0.0));
+
+        float x1 = box.x, y1 = box.y;
+        float x2 = box.x + box.width, y2 = box.y + box.height;
+        GLfloat vertex_data[] = {
+            x1, y1,
+            x2, y1,
+            x2, y2,
+            x1, y2,
+        };
 
-        if (!shapes_from_center)
+        auto& p = preview.points;
+        float radius = preview.method == annotate::ANNOTATE_METHOD_CIRCLE ?
+            annotate::stroke_radius(preview) : 0.0;
+
+        preview_program.use(wf::TEXTURE_TYPE_RGBA);
+        preview_program.uniformMatrix4f("matrix", matrix);
+        preview_program.uniform1i("shape", preview.method);
+        preview_program.uniform2f("p0", p[0].x, p[0].y);
+        preview_program.uniform2f("p1", p[1].x, p[1].y);
+        preview_program.uniform1f("radius", radius);
+        preview_program.uniform1f("half_width", preview.width / 2);
+        preview_program.uniform4f("color", glm::vec4{preview.r * preview.a,
+            preview.g * preview.a, preview.b * preview.a, preview.a});
+        preview_program.attrib_pointer("position", 2, 0, vertex_data);
+        GL_CALL(glEnable(GL_BLEND));
+        GL_CALL(glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA));
+
+        for (auto& damage_box : damage)
         {
-            radius /= 2;
-            from.x += (to.x - from.x) / 2;
-            from.y += (to.y - from.y) / 2;
+            fb.logic_scissor(wlr_box_from_pixman_box(damage_box));
+            GL_CALL(glDrawArrays(GL_TRIANGLE_FAN, 0, 4));
         }
 
-        cairo_set_line_width(cr, line_width);
-        cairo_set_source_rgba_swizzle(cr,
-            wf::color_t(stroke_color).r,
-            wf::color_t(stroke_color).g,
-            wf::color_t(stroke_color).b,
-            wf::color_t(stroke_color).a);
-        cairo_arc(cr, from.x, from.y, radius, 0, 2 * M_PI);
-        cairo_stroke(cr);
+        preview_program.deactivate();
+    }
 
-        OpenGL::render_begin();
-        cairo_surface_upload_to_texture(ol.cairo_surface, *ol.texture);
-        OpenGL::render_end();
+    void render_laser(const wf::framebuffer_t& fb, const wf::region_t& damage)
+    {
+        auto og = fb.geometry;
+        auto matrix = fb.get_orthographic_projection() *
+            glm::translate(glm::mat4(1.0), glm::vec3(og.x, og.y, 0.0));
+        wf::color_t color = stroke_color;
+
+        laser_program.use(wf::TEXTURE_TYPE_RGBA);
+        laser_program.uniformMatrix4f("matrix", matrix);
+        laser_program.uniform1f("now", laser.relative_time(wf::get_current_time()));
+        laser_program.uniform1f("duration", std::max(int(laser_duration), 1));
+        laser_program.uniform4f("color", glm::vec4{color.r * color.a,
+            color.g * color.a, color.b * color.a, color.a});
+        laser_program.attrib_pointer("position", 3, 0, laser.data());
+        GL_CALL(glEnable(GL_BLEND));
+        GL_CALL(glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA));
 
-        wlr_box bbox;
-        int padding = line_width + 1;
-        bbox.x = (from.x - radius) - padding;
-        bbox.y = (from.y - radius) - padding;
-        bbox.width = (radius * 2) + padding * 2;
-        bbox.height = (radius * 2) + padding * 2;
-        output->render->damage(bbox);
-        if (damage_last_bbox)
+        for (auto& box : damage)
         {
-            output->render->damage(last_bbox);
+            fb.logic_scissor(wlr_box_from_pixman_box(box));
+            GL_CALL(glDrawArrays(GL_TRIANGLES, 0, laser.vertex_count()));
         }
-        last_bbox = bbox;
+
+        laser_program.deactivate();
     }
 
     wf::signal_connection_t workspace_stream_post{[this] (wf::signal_data_t *data)
     {
         const auto& workspace = static_cast<wf::stream_signal_t*>(data);
         auto& ol = overlays[workspace->ws.x][workspace->ws.y];
-        auto og = workspace->fb.geometry;
+
+        if (ol.restore_pending)
+        {
+            queue_restore(workspace->ws);
+        }
+
+        ol.last_shown = wf::get_current_time();
+        if (ol.canvas.is_packed())
+        {
+            ol.canvas.unpack();
+            overlay_upload(ol.canvas);
+        }
+
+        if (workspace->ws != output->workspace->get_current_workspace())
+        {
+            schedule_evict();
+        }
         auto damage = output->render->get_scheduled_damage() &
             output->render->get_ws_box(workspace->ws);
 
         OpenGL::render_begin(workspace->fb);
-        for (auto& box : damage)
+        if (canvas_current(ol))
         {
-            workspace->fb.logic_scissor(wlr_box_from_pixman_box(box));
-            if (ol.cr)
-            {
-                OpenGL::render_texture(wf::texture_t{ol.texture->tex},
-                    workspace->fb, og, glm::vec4(1.0),
-                    OpenGL::TEXTURE_TRANSFORM_INVERT_Y);
-            }
-            if (shape_overlay.cr)
+            for (auto& box : damage)
             {
-                OpenGL::render_texture(wf::texture_t{shape_overlay.texture->tex},
-                    workspace->fb, og, glm::vec4(1.0),
-                    OpenGL::TEXTURE_TRANSFORM_INVERT_Y);
+                workspace->fb.logic_scissor(wlr_box_from_pixman_box(box));
+                render_overlay(ol.canvas, workspace->fb);
             }
+        } else
+        {
+            render_strokes(ol, workspace->fb, damage);
+        }
+
+        if (canvas_current(ol) && ol.vbo)
+        {
+            free_vertices(ol);
+        }
+
+        if (preview_active &&
+            (workspace->ws == output->workspace->get_current_workspace()))
+        {
+            render_preview(workspace->fb, damage);
+        }
+
+        if (!laser.empty() &&
+            (workspace->ws == output->workspace->get_current_workspace()))
+        {
+            render_laser(workspace->fb, damage);
         }
         OpenGL::render_end();
     }};
 
-    void grab()
+    bool grab()
     {
         if (!output->activate_plugin(grab_interface))
         {
-            return;
+            return false;
+        }
+
+        if (!grab_interface->grab())
+        {
+            output->deactivate_plugin(grab_interface);
+            return false;
         }
-        grab_interface->grab();
+
+        return true;
     }
 
     void ungrab()
@@ -554,21 +2004,53 @@ class wayfire_annotate_screen : public wf::plugin_interface_t
         hook_set = false;
     }
 
+    /* Wait for a running save and write what is left synchronously */
+    void flush_saves()
+    {
+        save_timer.disconnect();
+        save_worker.fini();
+        write_files(collect_dirty(), store_directory());
+    }
+
     void fini() override
     {
         ungrab();
+        fill_worker.fini();
+        disconnect_motion_hook();
+        disconnect_laser_hook();
         disconnect_ws_stream_post();
+        rebuild_worker.fini();
+        evict_timer.disconnect();
+        idle_restore.disconnect();
+        flush_saves();
+        wf::get_core().disconnect_signal("tablet_axis", &on_tablet_axis);
         output->rem_binding(&draw_begin);
         output->rem_binding(&clear_workspace);
+        output->rem_binding(&undo);
+        output->rem_binding(&redo);
         auto wsize = output->workspace->get_workspace_grid_size();
         for (int x = 0; x < wsize.width; x++)
         {
             for (int y = 0; y < wsize.height; y++)
             {
                 auto& ol = overlays[x][y];
-                overlay_destroy(ol);
+                overlay_destroy(ol.canvas);
+            }
+        }
+        OpenGL::render_begin();
+        for (int x = 0; x < wsize.width; x++)
+        {
+            for (int y = 0; y < wsize.height; y++)
+            {
+                free_vertices(overlays[x][y]);
             }
         }
+
+
+        stroke_program.free_resources();
+        preview_program.free_resources();
+        laser_program.free_resources();
+        OpenGL::render_end();
         output->render->damage_whole();
     }
 };
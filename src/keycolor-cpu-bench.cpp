@@ -0,0 +1,219 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Checks the scalar CPU keycolor kernel against the shader's test in
+ * floating point, and every other kernel this machine supports against
+ * the scalar one, then reports their throughput. Needs no GPU or
+ * compositor.
+ *
+ * Usage: keycolor-cpu-bench [width height iterations]
+ */
+
+#include <chrono>
+#include <random>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+#include "keycolor-cpu.hpp"
+
+using namespace keycolor_cpu;
+
+static const char *kernel_name(kernel_t kernel)
+{
+    switch (kernel)
+    {
+      case KERNEL_SSE41:
+        return "sse4.1";
+      case KERNEL_AVX2:
+        return "avx2";
+      case KERNEL_NEON:
+        return "neon";
+      default:
+        return "scalar";
+    }
+}
+
+/* Half the pixels are near the key color, like a terminal background,
+ * some of them on or just outside the edges of the keyed range */
+static std::vector<uint32_t> make_buffer(int width, int height,
+    const params_t& params, std::mt19937& rng)
+{
+    std::vector<uint32_t> buffer((size_t)width * height);
+
+    for (auto& px : buffer)
+    {
+        px = rng();
+        if (rng() % 2)
+        {
+            uint32_t keyed = 0;
+            for (int c = 0; c < 4; c++)
+            {
+                int v = (params.lo[c] + params.hi[c]) / 2 + (int)(rng() % 5) - 2;
+                switch (rng() % 8)
+                {
+                  case 0:
+                    v = params.lo[c] - 1 + rng() % 2;
+                    break;
+                  case 1:
+                    v = params.hi[c] + rng() % 2;
+                    break;
+                }
+
+                keyed |= (uint32_t)std::min(std::max(v, 0), 255) << (c * 8);
+            }
+
+            px = keyed;
+        }
+    }
+
+    return buffer;
+}
+
+/* What the keycolor shader computes for each pixel, in floating point */
+static void key_buffer_reference(uint32_t *buffer, size_t count, float r, float g,
+    float b, float opacity, float threshold, pixel_format_t format)
+{
+    const float key[4] = {b, g, r, 1.0f};
+    const uint32_t alpha_fill = format == PIXEL_FORMAT_XRGB8888 ? 0xff000000 : 0;
+    uint32_t opacity8 = std::lround(std::min(std::max(opacity, 0.0f), 1.0f) * 255.0f);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t px = buffer[i] | alpha_fill;
+        float diff  = 0;
+        for (int c = 0; c < 4; c++)
+        {
+            diff = std::max(diff, std::abs(key[c] - ((px >> (c * 8)) & 0xff) / 255.0f));
+        }
+
+        if (diff < threshold)
+        {
+            px = opacity8 << 24 |
+                mul_div255((px >> 16) & 0xff, opacity8) << 16 |
+                mul_div255((px >> 8) & 0xff, opacity8) << 8 |
+                mul_div255(px & 0xff, opacity8);
+        }
+
+        buffer[i] = px;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int width  = argc > 3 ? atoi(argv[1]) : 3840;
+    int height = argc > 3 ? atoi(argv[2]) : 2160;
+    int iterations = argc > 3 ? atoi(argv[3]) : 20;
+    int failures   = 0;
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+    /* The 8-bit ranges against the shader's test for every channel value */
+    for (int i = 0; i < 100000; i++)
+    {
+        float key = unit(rng), threshold = unit(rng) * 0.5;
+        uint8_t lo, hi;
+        channel_range(key, threshold, lo, hi);
+
+        for (int v = 0; v < 256; v++)
+        {
+            if (((v >= lo) && (v <= hi)) != channel_matches(key, threshold, v))
+            {
+                fprintf(stderr, "range [%d, %d] for key %.9g threshold %.9g "
+                                "is wrong for %d\n", lo, hi, key, threshold, v);
+                failures++;
+            }
+        }
+    }
+
+    /* Correctness over random parameters, odd widths cover the tails */
+    for (int i = 0; i < 1000; i++)
+    {
+        float r = unit(rng), g = unit(rng), b = unit(rng);
+        float opacity = unit(rng), threshold = unit(rng) * 0.5;
+        auto params = make_params(r, g, b, opacity, threshold);
+        auto input  = make_buffer(61, 3, params, rng);
+
+        for (auto format : {PIXEL_FORMAT_ARGB8888, PIXEL_FORMAT_XRGB8888})
+        {
+            auto expected = input;
+            key_buffer_reference(expected.data(), expected.size(), r, g, b,
+                opacity, threshold, format);
+
+            auto scalar = input;
+            key_buffer(KERNEL_SCALAR, scalar.data(), 61, 3, 61 * 4, params, format);
+            if (scalar != expected)
+            {
+                fprintf(stderr, "scalar does not match the shader's test\n");
+                failures++;
+            }
+
+            for (auto kernel : {KERNEL_SSE41, KERNEL_AVX2, KERNEL_NEON})
+            {
+                if (!kernel_supported(kernel))
+                {
+                    continue;
+                }
+
+                auto result = input;
+                key_buffer(kernel, result.data(), 61, 3, 61 * 4, params, format);
+                if (result != scalar)
+                {
+                    fprintf(stderr, "%s does not match scalar\n", kernel_name(kernel));
+                    failures++;
+                }
+            }
+        }
+    }
+
+    /* Throughput with the default keycolor options */
+    auto params = make_params(0, 0, 0, 0.25, 0.5);
+    auto input  = make_buffer(width, height, params, rng);
+
+    for (auto kernel : {KERNEL_SCALAR, KERNEL_SSE41, KERNEL_AVX2, KERNEL_NEON})
+    {
+        if (!kernel_supported(kernel))
+        {
+            continue;
+        }
+
+        auto buffer = input;
+        auto start  = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+        {
+            key_buffer(kernel, buffer.data(), width, height, width * 4,
+                params, PIXEL_FORMAT_ARGB8888);
+        }
+
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        double mpix = (double)width * height * iterations / 1e6;
+        printf("%-8s %9.1f Mpix/s %8.3f ms/frame\n", kernel_name(kernel),
+            mpix / elapsed.count(), elapsed.count() * 1000 / iterations);
+    }
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
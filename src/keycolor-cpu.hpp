@@ -0,0 +1,413 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2020 Scott Moreau
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+/*
+ * CPU implementation of the keycolor shader for ARGB8888 and XRGB8888
+ * buffers (premultiplied, 0xAARRGGBB in native endianness, so the bytes
+ * are B, G, R, A in memory on little endian machines).
+ *
+ * A pixel is keyed when the largest difference between any channel and
+ * the key color (alpha is compared against 1.0) is below the threshold.
+ * The range of 8-bit values that pass is found by evaluating the
+ * shader's test in single precision for every value, so it agrees with
+ * a GPU that evaluates it in single precision as well. Keyed pixels
+ * are multiplied by the opacity, which is quantized to 8 bits like the
+ * framebuffer the shader writes to, and their alpha is set to it.
+ *
+ * XRGB8888 input is treated as opaque and written back as ARGB8888.
+ */
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KEYCOLOR_CPU_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define KEYCOLOR_CPU_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace keycolor_cpu
+{
+enum pixel_format_t
+{
+    PIXEL_FORMAT_ARGB8888,
+    PIXEL_FORMAT_XRGB8888,
+};
+
+enum kernel_t
+{
+    KERNEL_SCALAR,
+    KERNEL_SSE41,
+    KERNEL_AVX2,
+    KERNEL_NEON,
+};
+
+struct params_t
+{
+    /* Inclusive range of 8-bit values that pass the test, per byte in
+     * memory order: B, G, R, A */
+    uint8_t lo[4];
+    uint8_t hi[4];
+    /* False if no 8-bit value can pass for some channel */
+    bool can_match;
+    uint8_t opacity;
+};
+
+/* The shader's test for one channel, as the GPU sees the uniforms */
+inline bool channel_matches(float key, float threshold, uint8_t v)
+{
+    return std::abs(key - v / 255.0f) < threshold;
+}
+
+/* The values that pass are contiguous, since the difference only grows
+ * on either side of the key. Rounding near the bounds makes a closed
+ * form disagree with the shader, so every value is tested. */
+inline bool channel_range(float key, float threshold, uint8_t& lo, uint8_t& hi)
+{
+    int low = 256, high = -1;
+    for (int v = 0; v < 256; v++)
+    {
+        if (channel_matches(key, threshold, v))
+        {
+            low  = std::min(low, v);
+            high = v;
+        }
+    }
+
+    if (low > high)
+    {
+        lo = 1;
+        hi = 0;
+        return false;
+    }
+
+    lo = low;
+    hi = high;
+    return true;
+}
+
+inline params_t make_params(double r, double g, double b,
+    double opacity, double threshold)
+{
+    params_t params;
+    double key[4] = {b, g, r, 1.0};
+
+    params.can_match = true;
+    for (int i = 0; i < 4; i++)
+    {
+        params.can_match &= channel_range(key[i], threshold,
+            params.lo[i], params.hi[i]);
+    }
+
+    params.opacity = std::lround(std::min(std::max(opacity, 0.0), 1.0) * 255.0);
+
+    return params;
+}
+
+/* round(v * opacity / 255) for 8-bit v and opacity */
+inline uint32_t mul_div255(uint32_t v, uint32_t opacity)
+{
+    uint32_t x = v * opacity + 127;
+    return (x + 1 + (x >> 8)) >> 8;
+}
+
+inline void key_row_scalar(uint32_t *row, size_t count,
+    const params_t& params, pixel_format_t format)
+{
+    const uint32_t alpha_fill = format == PIXEL_FORMAT_XRGB8888 ? 0xff000000 : 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        uint32_t px = row[i] | alpha_fill;
+        bool match  = params.can_match;
+
+        for (int c = 0; c < 4 && match; c++)
+        {
+            uint8_t v = px >> (c * 8);
+            match = v >= params.lo[c] && v <= params.hi[c];
+        }
+
+        if (match)
+        {
+            px = (uint32_t)params.opacity << 24 |
+                mul_div255((px >> 16) & 0xff, params.opacity) << 16 |
+                mul_div255((px >> 8) & 0xff, params.opacity) << 8 |
+                mul_div255(px & 0xff, params.opacity);
+        }
+
+        row[i] = px;
+    }
+}
+
+#if KEYCOLOR_CPU_X86
+__attribute__((target("sse4.1")))
+inline __m128i key_pixels_sse41(__m128i px, __m128i lo, __m128i hi,
+    __m128i opacity, __m128i alpha, __m128i alpha_fill)
+{
+    const __m128i zero  = _mm_setzero_si128();
+    const __m128i ones  = _mm_set1_epi32(-1);
+    const __m128i round = _mm_set1_epi16(127);
+    const __m128i one   = _mm_set1_epi16(1);
+
+    px = _mm_or_si128(px, alpha_fill);
+
+    __m128i in_range = _mm_cmpeq_epi8(_mm_max_epu8(_mm_min_epu8(px, hi), lo), px);
+    __m128i match    = _mm_cmpeq_epi32(in_range, ones);
+
+    __m128i l = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(px, zero), opacity), round);
+    __m128i h = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(px, zero), opacity), round);
+    l = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(l, one), _mm_srli_epi16(l, 8)), 8);
+    h = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(h, one), _mm_srli_epi16(h, 8)), 8);
+
+    __m128i keyed = _mm_blendv_epi8(_mm_packus_epi16(l, h), alpha,
+        _mm_set1_epi32((int32_t)0xff000000));
+
+    return _mm_blendv_epi8(px, keyed, match);
+}
+
+__attribute__((target("sse4.1")))
+inline void key_row_sse41(uint32_t *row, size_t count,
+    const params_t& params, pixel_format_t format)
+{
+    if (!params.can_match)
+    {
+        key_row_scalar(row, count, params, format);
+        return;
+    }
+
+    int32_t lo_bits, hi_bits;
+    std::memcpy(&lo_bits, params.lo, 4);
+    std::memcpy(&hi_bits, params.hi, 4);
+
+    const __m128i lo = _mm_set1_epi32(lo_bits);
+    const __m128i hi = _mm_set1_epi32(hi_bits);
+    const __m128i opacity    = _mm_set1_epi16(params.opacity);
+    const __m128i alpha      = _mm_set1_epi32((uint32_t)params.opacity << 24);
+    const __m128i alpha_fill = _mm_set1_epi32(
+        format == PIXEL_FORMAT_XRGB8888 ? (int32_t)0xff000000 : 0);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i px = _mm_loadu_si128((const __m128i*)(row + i));
+        px = key_pixels_sse41(px, lo, hi, opacity, alpha, alpha_fill);
+        _mm_storeu_si128((__m128i*)(row + i), px);
+    }
+
+    key_row_scalar(row + i, count - i, params, format);
+}
+
+__attribute__((target("avx2")))
+inline void key_row_avx2(uint32_t *row, size_t count,
+    const params_t& params, pixel_format_t format)
+{
+    if (!params.can_match)
+    {
+        key_row_scalar(row, count, params, format);
+        return;
+    }
+
+    int32_t lo_bits, hi_bits;
+    std::memcpy(&lo_bits, params.lo, 4);
+    std::memcpy(&hi_bits, params.hi, 4);
+
+    const __m256i lo = _mm256_set1_epi32(lo_bits);
+    const __m256i hi = _mm256_set1_epi32(hi_bits);
+    const __m256i opacity    = _mm256_set1_epi16(params.opacity);
+    const __m256i alpha      = _mm256_set1_epi32((uint32_t)params.opacity << 24);
+    const __m256i alpha_mask = _mm256_set1_epi32((int32_t)0xff000000);
+    const __m256i alpha_fill = _mm256_set1_epi32(
+        format == PIXEL_FORMAT_XRGB8888 ? (int32_t)0xff000000 : 0);
+    const __m256i zero  = _mm256_setzero_si256();
+    const __m256i ones  = _mm256_set1_epi32(-1);
+    const __m256i round = _mm256_set1_epi16(127);
+    const __m256i one   = _mm256_set1_epi16(1);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i px = _mm256_loadu_si256((const __m256i*)(row + i));
+        px = _mm256_or_si256(px, alpha_fill);
+
+        __m256i in_range = _mm256_cmpeq_epi8(
+            _mm256_max_epu8(_mm256_min_epu8(px, hi), lo), px);
+        __m256i match = _mm256_cmpeq_epi32(in_range, ones);
+
+        /* unpack and pack work within 128-bit lanes, so they cancel out */
+        __m256i l = _mm256_add_epi16(_mm256_mullo_epi16(
+            _mm256_unpacklo_epi8(px, zero), opacity), round);
+        __m256i h = _mm256_add_epi16(_mm256_mullo_epi16(
+            _mm256_unpackhi_epi8(px, zero), opacity), round);
+        l = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(l, one),
+            _mm256_srli_epi16(l, 8)), 8);
+        h = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(h, one),
+            _mm256_srli_epi16(h, 8)), 8);
+
+        __m256i keyed = _mm256_blendv_epi8(_mm256_packus_epi16(l, h),
+            alpha, alpha_mask);
+        px = _mm256_blendv_epi8(px, keyed, match);
+
+        _mm256_storeu_si256((__m256i*)(row + i), px);
+    }
+
+    key_row_sse41(row + i, count - i, params, format);
+}
+#endif
+
+#if KEYCOLOR_CPU_NEON
+inline void key_row_neon(uint32_t *row, size_t count,
+    const params_t& params, pixel_format_t format)
+{
+    if (!params.can_match)
+    {
+        key_row_scalar(row, count, params, format);
+        return;
+    }
+
+    uint32_t lo_bits, hi_bits;
+    std::memcpy(&lo_bits, params.lo, 4);
+    std::memcpy(&hi_bits, params.hi, 4);
+
+    const uint8x16_t lo = vreinterpretq_u8_u32(vdupq_n_u32(lo_bits));
+    const uint8x16_t hi = vreinterpretq_u8_u32(vdupq_n_u32(hi_bits));
+    const uint8x8_t opacity     = vdup_n_u8(params.opacity);
+    const uint8x16_t alpha      = vreinterpretq_u8_u32(
+        vdupq_n_u32((uint32_t)params.opacity << 24));
+    const uint8x16_t alpha_mask = vreinterpretq_u8_u32(vdupq_n_u32(0xff000000));
+    const uint8x16_t alpha_fill = vreinterpretq_u8_u32(vdupq_n_u32(
+        format == PIXEL_FORMAT_XRGB8888 ? 0xff000000 : 0));
+    const uint16x8_t round = vdupq_n_u16(127);
+    const uint16x8_t one   = vdupq_n_u16(1);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        uint8x16_t px = vreinterpretq_u8_u32(vld1q_u32(row + i));
+        px = vorrq_u8(px, alpha_fill);
+
+        uint8x16_t in_range = vceqq_u8(vmaxq_u8(vminq_u8(px, hi), lo), px);
+        uint8x16_t match    = vreinterpretq_u8_u32(vceqq_u32(
+            vreinterpretq_u32_u8(in_range), vdupq_n_u32(0xffffffff)));
+
+        uint16x8_t l = vaddq_u16(vmull_u8(vget_low_u8(px), opacity), round);
+        uint16x8_t h = vaddq_u16(vmull_u8(vget_high_u8(px), opacity), round);
+        l = vaddq_u16(vaddq_u16(l, one), vshrq_n_u16(l, 8));
+        h = vaddq_u16(vaddq_u16(h, one), vshrq_n_u16(h, 8));
+
+        uint8x16_t keyed = vcombine_u8(vshrn_n_u16(l, 8), vshrn_n_u16(h, 8));
+        keyed = vbslq_u8(alpha_mask, alpha, keyed);
+        px    = vbslq_u8(match, keyed, px);
+
+        vst1q_u32(row + i, vreinterpretq_u32_u8(px));
+    }
+
+    key_row_scalar(row + i, count - i, params, format);
+}
+#endif
+
+/* Whether the given kernel can run on this machine */
+inline bool kernel_supported(kernel_t kernel)
+{
+    switch (kernel)
+    {
+      case KERNEL_SCALAR:
+        return true;
+#if KEYCOLOR_CPU_X86
+      case KERNEL_SSE41:
+        return __builtin_cpu_supports("sse4.1");
+      case KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2");
+#endif
+#if KEYCOLOR_CPU_NEON
+      case KERNEL_NEON:
+        return true;
+#endif
+      default:
+        return false;
+    }
+}
+
+/* The fastest kernel this machine supports */
+inline kernel_t best_kernel()
+{
+    for (auto kernel : {KERNEL_AVX2, KERNEL_SSE41, KERNEL_NEON})
+    {
+        if (kernel_supported(kernel))
+        {
+            return kernel;
+        }
+    }
+
+    return KERNEL_SCALAR;
+}
+
+inline void key_row(kernel_t kernel, uint32_t *row, size_t count,
+    const params_t& params, pixel_format_t format)
+{
+    switch (kernel)
+    {
+#if KEYCOLOR_CPU_X86
+      case KERNEL_SSE41:
+        key_row_sse41(row, count, params, format);
+        return;
+      case KERNEL_AVX2:
+        key_row_avx2(row, count, params, format);
+        return;
+#endif
+#if KEYCOLOR_CPU_NEON
+      case KERNEL_NEON:
+        key_row_neon(row, count, params, format);
+        return;
+#endif
+      default:
+        key_row_scalar(row, count, params, format);
+        return;
+    }
+}
+
+/* Key a whole buffer in place. stride is in bytes. */
+inline void key_buffer(kernel_t kernel, void *data, int width, int height,
+    int stride, const params_t& params, pixel_format_t format)
+{
+    for (int y = 0; y < height; y++)
+    {
+        key_row(kernel, (uint32_t*)((uint8_t*)data + (size_t)y * stride),
+            width, params, format);
+    }
+}
+
+inline void key_buffer(void *data, int width, int height,
+    int stride, const params_t& params, pixel_format_t format)
+{
+    static const kernel_t kernel = best_kernel();
+    key_buffer(kernel, data, width, height, stride, params, format);
+}
+}
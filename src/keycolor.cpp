@@ -22,13 +22,29 @@
  * SOFTWARE.
  */
 
+#include <map>
+#include <cmath>
+#include <memory>
+#include <vector>
+#include <sstream>
+#include <algorithm>
 #include <wayfire/core.hpp>
+#include <wayfire/util.hpp>
 #include <wayfire/view.hpp>
 #include <wayfire/plugin.hpp>
 #include <wayfire/output.hpp>
+#include <wayfire/matcher.hpp>
 #include <wayfire/view-transform.hpp>
 #include <wayfire/workspace-manager.hpp>
 #include <wayfire/signal-definitions.hpp>
+#include <wayfire/util/log.hpp>
+
+extern "C"
+{
+#define static
+#include <wlr/types/wlr_surface.h>
+#undef static
+}
 
 
 static const char* vertex_shader =
@@ -73,7 +89,312 @@ void main()
 }
 )";
 
-OpenGL::program_t program;
+/* Keys against the main color exactly, like the shader above, and
+ * against the extra colors with one lookup in a 3D table, stored as
+ * LUT_SIZE slices along x of a 2D texture since GLES2 has no 3D
+ * textures. A texel holds the keyed opacity, the threshold for the
+ * alpha test and whether the cell is keyed at all. */
+static const char* fragment_shader_lut =
+R"(
+#version 100
+@builtin_ext@
+@builtin@
+
+#ifdef GL_FRAGMENT_PRECISION_HIGH
+precision highp float;
+#else
+precision mediump float;
+#endif
+
+uniform sampler2D lut;
+uniform float lut_size;
+uniform mediump vec4 color;
+uniform float threshold;
+
+varying mediump vec2 uvpos;
+
+void main()
+{
+    vec4 c = get_pixel(uvpos);
+    vec4 vdiff = abs(vec4(color.r, color.g, color.b, 1.0) - c);
+    float diff = max(max(max(vdiff.r, vdiff.g), vdiff.b), vdiff.a);
+    if (diff < threshold) {
+        c  *= color.a;
+        c.a = color.a;
+        gl_FragColor = c;
+        return;
+    }
+
+    vec3 cell = floor(clamp(c.rgb, 0.0, 1.0) * (lut_size - 1.0) + 0.5);
+    vec2 lut_pos = vec2((cell.b * lut_size + cell.r + 0.5) / (lut_size * lut_size),
+        (cell.g + 0.5) / lut_size);
+    vec4 key = texture2D(lut, lut_pos);
+    if (key.a > 0.5 && 1.0 - c.a < key.g) {
+        c  *= key.r;
+        c.a = key.r;
+    }
+    gl_FragColor = c;
+}
+)";
+
+/*
+ * Programs shared by every keycolor instance, keyed by shader source.
+ * All outputs render with the core's single GL context, so a program is
+ * compiled once and freed when its last user releases it. Transformers
+ * hold their own reference, because a view can outlive the plugin
+ * instance of the output it was keyed on.
+ */
+class keycolor_program_registry_t
+{
+    struct entry_t
+    {
+        OpenGL::program_t program;
+        int users = 0;
+    };
+
+    std::map<std::string, std::unique_ptr<entry_t>> programs;
+
+    public:
+    OpenGL::program_t *acquire(const std::string& vertex, const std::string& fragment)
+    {
+        auto& entry = programs[vertex + fragment];
+        if (!entry)
+        {
+            entry = std::make_unique<entry_t> ();
+            OpenGL::render_begin();
+            entry->program.compile(vertex, fragment);
+            OpenGL::render_end();
+        }
+
+        entry->users++;
+        return &entry->program;
+    }
+
+    void release(OpenGL::program_t *program)
+    {
+        for (auto it = programs.begin(); it != programs.end(); ++it)
+        {
+            if (&it->second->program != program)
+            {
+                continue;
+            }
+
+            if (--it->second->users == 0)
+            {
+                OpenGL::render_begin();
+                it->second->program.free_resources();
+                OpenGL::render_end();
+                programs.erase(it);
+            }
+
+            return;
+        }
+    }
+};
+
+static keycolor_program_registry_t program_registry;
+
+/*
+ * Lookup table for keying several colors at once, shared by all views.
+ * The main color comes from color/opacity/threshold as before, further
+ * ones from extra_keys, a ';' separated list of
+ * "<color> <opacity> <threshold>" entries, for example
+ * "#282828 0.25 0.1; #1d2021 0.5 0.05". The main color is always
+ * tested exactly, the table only holds the extra ones and is only used
+ * when there are any. A cell is keyed when any color that rounds to it
+ * is within the threshold of an extra key, so their edges are accurate
+ * to one cell.
+ */
+class keycolor_lut_t
+{
+    struct key_t
+    {
+        wf::color_t color;
+        double opacity;
+        double threshold;
+    };
+
+    wf::option_wrapper_t<wf::color_t> color{"keycolor/color"};
+    wf::option_wrapper_t<double> opacity{"keycolor/opacity"};
+    wf::option_wrapper_t<double> threshold{"keycolor/threshold"};
+    wf::option_wrapper_t<std::string> extra_keys{"keycolor/extra_keys"};
+    wf::config::option_base_t::updated_callback_t option_changed;
+    std::vector<key_t> keys;
+    GLuint tex = 0;
+    bool dirty = true;
+
+    keycolor_lut_t()
+    {
+        option_changed = [=] ()
+        {
+            dirty = true;
+        };
+
+        color.set_callback(option_changed);
+        opacity.set_callback(option_changed);
+        threshold.set_callback(option_changed);
+        extra_keys.set_callback(option_changed);
+    }
+
+    void parse_keys()
+    {
+        keys.clear();
+        keys.push_back({color, opacity, threshold});
+
+        std::stringstream list{(std::string)extra_keys};
+        std::string entry;
+        while (std::getline(list, entry, ';'))
+        {
+            std::stringstream fields{entry};
+            std::string color_str;
+            key_t key;
+
+            if (!(fields >> color_str >> key.opacity >> key.threshold))
+            {
+                continue;
+            }
+
+            auto parsed = wf::option_type::from_string<wf::color_t>(color_str);
+            if (!parsed)
+            {
+                LOGE("keycolor: invalid color in extra_keys: ", color_str);
+                continue;
+            }
+
+            key.color = parsed.value();
+            keys.push_back(key);
+        }
+    }
+
+    /* The channel values that round to cell i */
+    static std::pair<double, double> cell_range(int i)
+    {
+        return {std::max((i - 0.5) / (LUT_SIZE - 1), 0.0),
+            std::min((i + 0.5) / (LUT_SIZE - 1), 1.0)};
+    }
+
+    static bool range_matches(std::pair<double, double> range, double key,
+        double key_threshold)
+    {
+        return (range.first < key + key_threshold) &&
+               (range.second > key - key_threshold);
+    }
+
+    void build_table()
+    {
+        std::vector<uint8_t> texels(LUT_SIZE * LUT_SIZE * LUT_SIZE * 4, 0);
+
+        for (int g = 0; g < LUT_SIZE; g++)
+        {
+            for (int b = 0; b < LUT_SIZE; b++)
+            {
+                for (int r = 0; r < LUT_SIZE; r++)
+                {
+                    glm::vec3 cell = glm::vec3(r, g, b) / float(LUT_SIZE - 1);
+                    const key_t *best = nullptr;
+                    double best_diff  = 0;
+
+                    /* Extra keys only, the main one is tested in the shader */
+                    for (size_t i = 1; i < keys.size(); i++)
+                    {
+                        auto& key = keys[i];
+                        if (!range_matches(cell_range(r), key.color.r, key.threshold) ||
+                            !range_matches(cell_range(g), key.color.g, key.threshold) ||
+                            !range_matches(cell_range(b), key.color.b, key.threshold))
+                        {
+                            continue;
+                        }
+
+                        /* Where keys overlap, the one closest to the cell wins */
+                        double diff = std::max({
+                            std::abs(key.color.r - cell.r),
+                            std::abs(key.color.g - cell.g),
+                            std::abs(key.color.b - cell.b)});
+                        if (!best || (diff < best_diff))
+                        {
+                            best = &key;
+                            best_diff = diff;
+                        }
+                    }
+
+                    if (!best)
+                    {
+                        continue;
+                    }
+
+                    uint8_t *texel = &texels[((g * LUT_SIZE + b) * LUT_SIZE + r) * 4];
+                    texel[0] = std::lround(std::clamp(best->opacity, 0.0, 1.0) * 255);
+                    texel[1] = std::lround(std::clamp(best->threshold, 0.0, 1.0) * 255);
+                    texel[3] = 255;
+                }
+            }
+        }
+
+        if (!tex)
+        {
+            GL_CALL(glGenTextures(1, &tex));
+        }
+
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, tex));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+        GL_CALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, LUT_SIZE * LUT_SIZE,
+            LUT_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, texels.data()));
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+    }
+
+    public:
+    static constexpr int LUT_SIZE = 32;
+
+    static std::shared_ptr<keycolor_lut_t> get()
+    {
+        static std::weak_ptr<keycolor_lut_t> instance;
+        auto lut = instance.lock();
+        if (!lut)
+        {
+            lut = std::shared_ptr<keycolor_lut_t>(new keycolor_lut_t());
+            instance = lut;
+        }
+
+        return lut;
+    }
+
+    /* Whether there is more than the main key color. Must be called with
+     * the GL context current, it rebuilds the table if needed. */
+    bool update()
+    {
+        if (!dirty)
+        {
+            return keys.size() > 1;
+        }
+
+        dirty = false;
+        parse_keys();
+        if (keys.size() > 1)
+        {
+            build_table();
+        }
+
+        return keys.size() > 1;
+    }
+
+    GLuint get_texture()
+    {
+        return tex;
+    }
+
+    ~keycolor_lut_t()
+    {
+        if (tex)
+        {
+            OpenGL::render_begin();
+            GL_CALL(glDeleteTextures(1, &tex));
+            OpenGL::render_end();
+        }
+    }
+};
 
 class wf_keycolor : public wf::view_transformer_t
 {
@@ -82,6 +403,28 @@ class wf_keycolor : public wf::view_transformer_t
     wf::option_wrapper_t<wf::color_t> color{"keycolor/color"};
     wf::option_wrapper_t<double> opacity{"keycolor/opacity"};
     wf::option_wrapper_t<double> threshold{"keycolor/threshold"};
+    wf::option_wrapper_t<std::string> extra_keys{"keycolor/extra_keys"};
+    /* A wlr_surface of the view and where it is relative to the view's
+     * main surface. The surface is cleared when it is destroyed. */
+    struct tracked_surface_t
+    {
+        wlr_surface *surface;
+        wf::point_t offset;
+        wf::wl_listener_wrapper on_commit, on_destroy;
+    };
+
+    std::vector<std::unique_ptr<tracked_surface_t>> tracked;
+    OpenGL::program_t *program;
+    OpenGL::program_t *lut_program;
+    OpenGL::program_t *active_program = nullptr;
+    std::shared_ptr<keycolor_lut_t> lut;
+
+    /* Keyed contents of the view, in the same layout as the snapshot
+     * the core passes to the transformer. Only the parts in cache_damage,
+     * in view-local logical coordinates, are keyed again. */
+    wf::framebuffer_base_t cached;
+    wf::region_t cache_damage;
+    bool cache_valid = false;
 
     uint32_t get_z_order() override
     {
@@ -105,42 +448,203 @@ class wf_keycolor : public wf::view_transformer_t
     wf_keycolor(wayfire_view view) : wf::view_transformer_t()
     {
         this->view = view;
+        program = program_registry.acquire(vertex_shader, fragment_shader);
+        lut_program = program_registry.acquire(vertex_shader, fragment_shader_lut);
+        lut = keycolor_lut_t::get();
 
         option_changed = [=] ()
         {
+            cache_valid = false;
             this->view->damage();
         };
 
         color.set_callback(option_changed);
         opacity.set_callback(option_changed);
         threshold.set_callback(option_changed);
+        extra_keys.set_callback(option_changed);
+
+        view->connect_signal("region-damaged", &view_damaged);
+        track_surfaces();
+    }
+
+    /*
+     * Listen to the commits of the main surface and every subsurface.
+     * The surfaces may not exist yet when the transformer is added, come
+     * and go, or be destroyed before the transformer when the view is
+     * closed with an animation. When they changed or moved, the whole
+     * view is keyed again. Only called while rendering, since listeners
+     * can't be removed while their signal is emitted.
+     */
+    void track_surfaces()
+    {
+        std::vector<std::pair<wlr_surface*, wf::point_t>> current;
+        for (auto& child : view->enumerate_surfaces({0, 0}))
+        {
+            if (auto surface = child.surface->get_wlr_surface())
+            {
+                current.push_back({surface, child.position});
+            }
+        }
+
+        if (std::equal(current.begin(), current.end(), tracked.begin(), tracked.end(),
+            [] (const auto& a, const std::unique_ptr<tracked_surface_t>& b)
+        {
+            return (a.first == b->surface) && (a.second == b->offset);
+        }))
+        {
+            return;
+        }
+
+        tracked.clear();
+        cache_valid = false;
+        for (auto& [surface, offset] : current)
+        {
+            auto entry = std::make_unique<tracked_surface_t>();
+            auto raw   = entry.get();
+            entry->surface = surface;
+            entry->offset  = offset;
+            entry->on_commit.set_callback([=] (void*)
+            {
+                surface_committed(*raw);
+            });
+            entry->on_destroy.set_callback([=] (void*)
+            {
+                raw->on_commit.disconnect();
+                raw->on_destroy.disconnect();
+                raw->surface = nullptr;
+                cache_valid  = false;
+            });
+            entry->on_commit.connect(&surface->events.commit);
+            entry->on_destroy.connect(&surface->events.destroy);
+            tracked.push_back(std::move(entry));
+        }
+    }
+
+    /* From the view's main surface to the cache, which covers the
+     * bounding box including decorations */
+    wf::point_t cache_offset()
+    {
+        auto bbox = view->get_untransformed_bounding_box();
+        auto og   = view->get_output_geometry();
+
+        return {og.x - bbox.x, og.y - bbox.y};
+    }
+
+    /* Decorations are redrawn without a commit, and the core does not
+     * say where the view was damaged, so they are keyed again whenever
+     * it is. Commits are picked up by the surface listeners. */
+    wf::signal_connection_t view_damaged{[this] (wf::signal_data_t *data)
+    {
+        auto offset = cache_offset();
+        for (auto& child : view->enumerate_surfaces({0, 0}))
+        {
+            if (child.surface->get_wlr_surface())
+            {
+                continue;
+            }
+
+            auto size = child.surface->get_size();
+            cache_damage |= wlr_box{child.position.x + offset.x,
+                child.position.y + offset.y, size.width, size.height};
+        }
+    }};
+
+    void surface_committed(tracked_surface_t& tracked_surface)
+    {
+        wf::region_t damage;
+        wlr_surface_get_effective_damage(tracked_surface.surface, damage.to_pixman());
+        damage += tracked_surface.offset + cache_offset();
+        cache_damage |= damage;
     }
 
-    void render_box(wf::texture_t src_tex, wlr_box _src_box,
+    void render_box(wf::texture_t src_tex, wlr_box src_box,
         wlr_box scissor_box, const wf::framebuffer_t& target_fb) override
     {
-        auto src_box = _src_box;
-        int fb_h = target_fb.viewport_height;
+        render_with_damage(src_tex, src_box, wf::region_t{scissor_box}, target_fb);
+    }
 
-        src_box.x -= target_fb.geometry.x;
-        src_box.y -= target_fb.geometry.y;
+    /* The default implementation calls render_box() once per damage
+     * rectangle, which sets up the program and GL state each time. Set
+     * them up once per frame and only change the scissor in between. */
+    void render_with_damage(wf::texture_t src_tex, wlr_box src_box,
+        const wf::region_t& damage, const wf::framebuffer_t& target_fb) override
+    {
+        if (damage.empty())
+        {
+            return;
+        }
 
-        float x = src_box.x, y = src_box.y, w = src_box.width, h = src_box.height;
+        update_cache(src_tex, src_box, target_fb.scale);
 
-        static const float vertexData[] = {
-            -1.0f, -1.0f,
-             1.0f, -1.0f,
-             1.0f,  1.0f,
-            -1.0f,  1.0f
-        };
-        static const float texCoords[] = {
-             0.0f, 0.0f,
-             1.0f, 0.0f,
-             1.0f, 1.0f,
-             0.0f, 1.0f
-        };
+        /* A negative threshold never matches, so the cached contents
+         * are composited as they are. */
+        render_pass(wf::texture_t{cached.tex}, src_box, damage, target_fb, -1.0);
+    }
 
-        OpenGL::render_begin(target_fb);
+    /* Key the damaged parts of the snapshot into the cache. The whole
+     * cache is redone when the view changes size. */
+    void update_cache(wf::texture_t src_tex, wlr_box src_box, float scale)
+    {
+        int width = src_box.width * scale;
+        int height = src_box.height * scale;
+
+        track_surfaces();
+        OpenGL::render_begin();
+        if (cached.allocate(width, height) || !cache_valid)
+        {
+            cache_damage |= wlr_box{0, 0, src_box.width, src_box.height};
+            cache_valid = true;
+        }
+
+        cache_damage &= wlr_box{0, 0, src_box.width, src_box.height};
+        if (cache_damage.empty())
+        {
+            OpenGL::render_end();
+            return;
+        }
+
+        cached.bind();
+        GL_CALL(glViewport(0, 0, width, height));
+        GL_CALL(glEnable(GL_SCISSOR_TEST));
+        if (lut->update())
+        {
+            setup_lut_program(src_tex, threshold);
+        } else
+        {
+            setup_program(src_tex, threshold);
+        }
+
+        for (const auto& b : cache_damage)
+        {
+            auto box = wlr_box_from_pixman_box(b);
+            GL_CALL(glScissor(box.x * scale, height - (box.y + box.height) * scale,
+                std::ceil(box.width * scale), std::ceil(box.height * scale)));
+            GL_CALL(glDrawArrays(GL_TRIANGLE_FAN, 0, 4));
+        }
+
+        GL_CALL(glDisable(GL_SCISSOR_TEST));
+        teardown_program();
+        OpenGL::render_end();
+
+        cache_damage.clear();
+    }
+
+    static constexpr float vertex_data[] = {
+        -1.0f, -1.0f,
+         1.0f, -1.0f,
+         1.0f,  1.0f,
+        -1.0f,  1.0f
+    };
+    static constexpr float tex_coords[] = {
+         0.0f, 0.0f,
+         1.0f, 0.0f,
+         1.0f, 1.0f,
+         0.0f, 1.0f
+    };
+
+    void setup_program(wf::texture_t src_tex, float key_threshold)
+    {
+        active_program = program;
 
         /* Upload data to shader */
         glm::vec4 color_data{
@@ -148,40 +652,111 @@ class wf_keycolor : public wf::view_transformer_t
             ((wf::color_t)color).g,
             ((wf::color_t)color).b,
             (double)opacity};
-        program.use(src_tex.type);
-        program.uniform4f("color", color_data);
-        program.uniform1f("threshold", threshold);
-        program.attrib_pointer("position", 2, 0, vertexData);
-        program.attrib_pointer("texcoord", 2, 0, texCoords);
+        program->use(src_tex.type);
+        program->uniform4f("color", color_data);
+        program->uniform1f("threshold", key_threshold);
+        program->attrib_pointer("position", 2, 0, vertex_data);
+        program->attrib_pointer("texcoord", 2, 0, tex_coords);
         GL_CALL(glActiveTexture(GL_TEXTURE0));
-        program.set_active_texture(src_tex);
+        program->set_active_texture(src_tex);
+    }
+
+    void setup_lut_program(wf::texture_t src_tex, float key_threshold)
+    {
+        active_program = lut_program;
+
+        glm::vec4 color_data{
+            ((wf::color_t)color).r,
+            ((wf::color_t)color).g,
+            ((wf::color_t)color).b,
+            (double)opacity};
+        lut_program->use(src_tex.type);
+        lut_program->uniform4f("color", color_data);
+        lut_program->uniform1f("threshold", key_threshold);
+        lut_program->uniform1i("lut", 1);
+        lut_program->uniform1f("lut_size", keycolor_lut_t::LUT_SIZE);
+        lut_program->attrib_pointer("position", 2, 0, vertex_data);
+        lut_program->attrib_pointer("texcoord", 2, 0, tex_coords);
+        GL_CALL(glActiveTexture(GL_TEXTURE1));
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, lut->get_texture()));
+        GL_CALL(glActiveTexture(GL_TEXTURE0));
+        lut_program->set_active_texture(src_tex);
+    }
+
+    void teardown_program()
+    {
+        GL_CALL(glActiveTexture(GL_TEXTURE1));
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+        GL_CALL(glActiveTexture(GL_TEXTURE0));
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+        GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+
+        active_program->deactivate();
+    }
+
+    void render_pass(wf::texture_t src_tex, wlr_box _src_box,
+        const wf::region_t& damage, const wf::framebuffer_t& target_fb,
+        float key_threshold)
+    {
+        auto src_box = _src_box;
+        int fb_h = target_fb.viewport_height;
+
+        src_box.x -= target_fb.geometry.x;
+        src_box.y -= target_fb.geometry.y;
+
+        float x = src_box.x, y = src_box.y, w = src_box.width, h = src_box.height;
+
+        OpenGL::render_begin(target_fb);
+        setup_program(src_tex, key_threshold);
 
         /* Render it to target_fb */
         target_fb.bind();
 
         GL_CALL(glViewport(x, fb_h - y - h, w, h));
-        target_fb.scissor(scissor_box);
         GL_CALL(glEnable(GL_BLEND));
         GL_CALL(glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA));
 
-        GL_CALL(glDrawArrays(GL_TRIANGLE_FAN, 0, 4));
+        for (const auto& box : damage)
+        {
+            target_fb.logic_scissor(wlr_box_from_pixman_box(box));
+            GL_CALL(glDrawArrays(GL_TRIANGLE_FAN, 0, 4));
+        }
 
         /* Disable stuff */
         GL_CALL(glDisable(GL_BLEND));
-        GL_CALL(glActiveTexture(GL_TEXTURE0));
-        GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
-        GL_CALL(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+        teardown_program();
+        OpenGL::render_end();
+    }
 
-        program.deactivate();
+    virtual ~wf_keycolor()
+    {
+        tracked.clear();
+        OpenGL::render_begin();
+        cached.release();
         OpenGL::render_end();
+        program_registry.release(program);
+        program_registry.release(lut_program);
     }
+};
+
+/* Set on views whose keying state was flipped with the toggle binding,
+ * so that the match rules do not override the user's choice. */
+class keycolor_toggled_t : public wf::custom_data_t
+{
+    public:
+    bool enabled;
 
-    virtual ~wf_keycolor() {}
+    keycolor_toggled_t(bool enabled) : enabled(enabled) {}
 };
 
 class wayfire_keycolor : public wf::plugin_interface_t
 {
     const std::string transformer_name = "keycolor";
+    wf::view_matcher_t keycolor_by_default{"keycolor/keycolor_by_default"};
+    wf::option_wrapper_t<std::string> keycolor_by_default_opt{"keycolor/keycolor_by_default"};
+    wf::option_wrapper_t<wf::activatorbinding_t> toggle_binding{"keycolor/toggle"};
+    wf::wl_idle_call idle_update;
+    OpenGL::program_t *program;
 
     void add_transformer(wayfire_view view)
     {
@@ -210,48 +785,95 @@ class wayfire_keycolor : public wf::plugin_interface_t
         }
     }
 
-    public:
-    void init() override
+    bool should_key(wayfire_view view)
     {
-        grab_interface->name = transformer_name;
-        grab_interface->capabilities = 0;
+        if (view->role == wf::VIEW_ROLE_DESKTOP_ENVIRONMENT)
+        {
+            return false;
+        }
 
-        OpenGL::render_begin();
-        program.compile(vertex_shader, fragment_shader);
-        OpenGL::render_end();
+        if (view->has_data<keycolor_toggled_t>())
+        {
+            return view->get_data<keycolor_toggled_t>()->enabled;
+        }
 
-        output->connect_signal("attach-view", &view_attached);
+        return keycolor_by_default.matches(view);
+    }
 
-        for (auto& view : output->workspace->get_views_in_layer(wf::ALL_LAYERS))
+    void update_transformer(wayfire_view view)
+    {
+        if (should_key(view))
         {
-            if (view->role == wf::VIEW_ROLE_DESKTOP_ENVIRONMENT)
-            {
-                continue;
-            }
-
             add_transformer(view);
         }
+        else
+        {
+            pop_transformer(view);
+        }
     }
 
-    wf::signal_connection_t view_attached{[this] (wf::signal_data_t *data)
+    void update_transformers()
     {
-        auto view = get_signaled_view(data);
+        for (auto& view : output->workspace->get_views_in_layer(wf::ALL_LAYERS))
+        {
+            update_transformer(view);
+        }
+    }
 
-        if (view->role == wf::VIEW_ROLE_DESKTOP_ENVIRONMENT)
+    wf::activator_callback toggle_cb = [=] (wf::activator_source_t, uint32_t)
+    {
+        auto view = output->get_active_view();
+        if (!view || view->role == wf::VIEW_ROLE_DESKTOP_ENVIRONMENT)
         {
-            return;
+            return false;
         }
 
-        if(!view->get_transformer(transformer_name))
-            add_transformer(view);
+        bool enabled = !view->get_transformer(transformer_name);
+        view->store_data(std::make_unique<keycolor_toggled_t> (enabled));
+        update_transformer(view);
+
+        return true;
+    };
+
+    /* The matcher reparses its option in its own callback, so wait
+     * until that has run before evaluating the new rules. */
+    wf::config::option_base_t::updated_callback_t matcher_changed = [=] ()
+    {
+        idle_update.run_once([=] ()
+        {
+            update_transformers();
+        });
+    };
+
+    public:
+    void init() override
+    {
+        grab_interface->name = transformer_name;
+        grab_interface->capabilities = 0;
+
+        program = program_registry.acquire(vertex_shader, fragment_shader);
+
+        output->connect_signal("attach-view", &view_attached);
+        output->connect_signal("map-view", &view_attached);
+        output->add_activator(toggle_binding, &toggle_cb);
+        keycolor_by_default_opt.set_callback(matcher_changed);
+
+        update_transformers();
+    }
+
+    /* app-id and title are usually not known until the view is mapped,
+     * so the rules are evaluated again on map. */
+    wf::signal_connection_t view_attached{[this] (wf::signal_data_t *data)
+    {
+        update_transformer(get_signaled_view(data));
     }};
 
     void fini() override
     {
+        idle_update.disconnect();
+        output->rem_binding(&toggle_cb);
         remove_transformers();
-        OpenGL::render_begin();
-        program.free_resources();
-        OpenGL::render_end();
+        program_registry.release(program);
     }
 };
 
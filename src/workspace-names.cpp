@@ -34,6 +34,7 @@
  */
 
 #include <map>
+#include <optional>
 #include <wayfire/util.hpp>
 #include <wayfire/plugin.hpp>
 #include <wayfire/output.hpp>
@@ -46,16 +47,140 @@
 #include <wayfire/plugins/common/cairo-util.hpp>
 
 #define WIDGET_PADDING 20
+/* Transparent border around each label in the atlas, so filtering
+ * never samples a neighbour */
+#define ATLAS_MARGIN 1
 
 class workspace_name
 {
     public:
-    wf::geometry_t rect;
+    /* Output-local, the size is zero until the label is first rendered */
+    wf::geometry_t rect = {0, 0, 0, 0};
     std::string name;
-    std::unique_ptr<wf::simple_texture_t> texture;
-    cairo_t *cr = nullptr;
-    cairo_surface_t *cairo_surface;
-    cairo_text_extents_t text_extents;
+    /* Where the label is in the atlas, margin included. Empty if it has
+     * no place there at the moment. */
+    wf::geometry_t slot = {0, 0, 0, 0};
+    /* Name or look changed, rendered again before it is next shown */
+    bool stale = true;
+};
+
+/*
+ * All labels of an output share one texture, so they are drawn with a
+ * single binding and have no surface of their own. Labels are packed on
+ * shelves, each as tall as the first label placed on it. Labels of an
+ * output usually have the same height, so little space is lost.
+ */
+class label_atlas
+{
+    struct shelf_t
+    {
+        int y, height;
+        /* Where the next label on the shelf goes */
+        int x;
+    };
+
+    std::vector<shelf_t> shelves;
+
+    public:
+    GLuint tex = 0;
+    int width = 0, height = 0;
+
+    /* Drops all labels. Must be called with the GL context current. */
+    void resize(int w, int h)
+    {
+        release();
+        width  = w;
+        height = h;
+
+        GL_CALL(glGenTextures(1, &tex));
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, tex));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+        GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+        GL_CALL(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0,
+            GL_RGBA, GL_UNSIGNED_BYTE, nullptr));
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+    }
+
+    /* Forget all slots, the texture is kept and overwritten as labels
+     * are placed again */
+    void clear()
+    {
+        shelves.clear();
+    }
+
+    bool empty() const
+    {
+        return shelves.empty();
+    }
+
+    /* Find room for a w x h slot, false if the atlas is full */
+    bool allocate(int w, int h, wf::geometry_t& slot)
+    {
+        if (w > width)
+        {
+            return false;
+        }
+
+        for (auto& shelf : shelves)
+        {
+            if ((h <= shelf.height) && (shelf.x + w <= width))
+            {
+                slot = {shelf.x, shelf.y, w, h};
+                shelf.x += w;
+                return true;
+            }
+        }
+
+        int y = shelves.empty() ? 0 : shelves.back().y + shelves.back().height;
+        if (y + h > height)
+        {
+            return false;
+        }
+
+        shelves.push_back({y, h, w});
+        slot = {0, y, w, h};
+
+        return true;
+    }
+
+    /* Replace the contents of slot, the surface must be as large as the
+     * slot. Must be called with the GL context current. */
+    void upload(cairo_surface_t *surface, const wf::geometry_t& slot)
+    {
+        cairo_surface_flush(surface);
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, tex));
+        GL_CALL(glTexSubImage2D(GL_TEXTURE_2D, 0, slot.x, slot.y,
+            slot.width, slot.height, GL_RGBA, GL_UNSIGNED_BYTE,
+            cairo_image_surface_get_data(surface)));
+        GL_CALL(glBindTexture(GL_TEXTURE_2D, 0));
+    }
+
+    /* The label in slot, without its margin */
+    wf::texture_t texture(const wf::geometry_t& slot)
+    {
+        wf::texture_t texture{tex};
+        texture.has_viewport = true;
+        texture.viewport_box.x1 = float(slot.x + ATLAS_MARGIN) / width;
+        texture.viewport_box.y1 = float(slot.y + ATLAS_MARGIN) / height;
+        texture.viewport_box.x2 = float(slot.x + slot.width - ATLAS_MARGIN) / width;
+        texture.viewport_box.y2 = float(slot.y + slot.height - ATLAS_MARGIN) / height;
+
+        return texture;
+    }
+
+    /* Must be called with the GL context current */
+    void release()
+    {
+        if (tex)
+        {
+            GL_CALL(glDeleteTextures(1, &tex));
+            tex = 0;
+        }
+
+        shelves.clear();
+    }
 };
 
 class wayfire_workspace_names_screen : public wf::plugin_interface_t
@@ -64,6 +189,12 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
     bool hook_set = false;
     bool timed_out = false;
     std::vector<std::vector<workspace_name>> workspaces;
+    label_atlas atlas;
+    /* Only used to measure text */
+    cairo_surface_t *measure_surface = nullptr;
+    cairo_t *measure_cr = nullptr;
+    /* Names set in the config for this output, by workspace number - 1 */
+    std::vector<std::optional<std::string>> configured_names;
     wf::option_wrapper_t<std::string> font{"workspace-names/font"};
     wf::option_wrapper_t<std::string> position{"workspace-names/position"};
     wf::option_wrapper_t<int> display_duration{"workspace-names/display_duration"};
@@ -88,6 +219,9 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
             workspaces[x].resize(wsize.height);
         }
 
+        parse_names();
+
+        wf::get_core().connect_signal("reload-config", &reload_config);
         output->connect_signal("reserved-workarea", &workarea_changed);
         output->connect_signal("viewport-changed", &viewport_changed);
         font.set_callback(option_changed);
@@ -100,15 +234,11 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
         {
             show_options_changed();
         }
-        else
-        {
-            update_names();
-        }
     }
 
     wf::config::option_base_t::updated_callback_t show_options_changed = [=] ()
     {
-        update_names();
+        invalidate_labels();
 
         viewport_changed.emit(nullptr);
 
@@ -127,9 +257,53 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
         output->render->damage_whole();
     };
 
-    void update_name(int x, int y)
+    /*
+     * Collect the <output>_workspace_<n> options of this output in one
+     * pass over the section. Returns whether any name changed.
+     */
+    bool parse_names()
     {
         auto section = wf::get_core().config.get_section(grab_interface->name);
+        auto wsize   = output->workspace->get_workspace_grid_size();
+        auto prefix  = output->to_string() + "_workspace_";
+        std::vector<std::optional<std::string>> names(wsize.width * wsize.height);
+
+        for (auto option : section->get_registered_options())
+        {
+            auto option_name = option->get_name();
+            if (option_name.compare(0, prefix.size(), prefix) != 0)
+            {
+                continue;
+            }
+
+            /* Like sscanf("%d") did, anything after the number is ignored */
+            const char *start = option_name.c_str() + prefix.size();
+            char *end;
+            long ws = strtol(start, &end, 10);
+            if ((end == start) || (ws < 1) || (ws > (long)names.size()) || names[ws - 1])
+            {
+                continue;
+            }
+
+            names[ws - 1] = option->get_value_str();
+        }
+
+        bool changed = names != configured_names;
+        configured_names = std::move(names);
+
+        return changed;
+    }
+
+    wf::signal_connection_t reload_config{[this] (wf::signal_data_t *data)
+    {
+        if (parse_names() && !show_option_names)
+        {
+            invalidate_labels();
+        }
+    }};
+
+    void update_name(int x, int y)
+    {
         auto wsize = output->workspace->get_workspace_grid_size();
         workspace_name& wsn = workspaces[x][y];
         int ws_num = x + y * wsize.width + 1;
@@ -139,110 +313,140 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
             wsn.name = output->to_string() + "_workspace_" +
                 std::to_string(ws_num);
         }
+        else if (configured_names[ws_num - 1])
+        {
+            wsn.name = *configured_names[ws_num - 1];
+        }
         else
         {
-            bool option_found = false;
-            for (auto option : section->get_registered_options())
-            {
-                int ws;
-                if (sscanf(option->get_name().c_str(),
-                    (output->to_string() + "_workspace_%d").c_str(), &ws) == 1)
-                {
-                    if (ws == ws_num)
-                    {
-                        wsn.name = option->get_value_str();
-                        option_found = true;
-                        break;
-                    }
-                }
-            }
-            if (!option_found)
-            {
-                wsn.name = "Workspace " + std::to_string(ws_num);
-            }
+            wsn.name = "Workspace " + std::to_string(ws_num);
         }
     }
 
-    void update_names()
+    /*
+     * Labels are only rendered when their workspace is about to be
+     * shown, most of them never are between two changes.
+     */
+    void invalidate_labels()
     {
-        auto wsize = output->workspace->get_workspace_grid_size();
-        for (int x = 0; x < wsize.width; x++)
+        for (auto& column : workspaces)
         {
-            for (int y = 0; y < wsize.height; y++)
+            for (auto& wsn : column)
             {
-                update_name(x, y);
-                update_texture(workspaces[x][y]);
+                wsn.stale = true;
             }
         }
-    }
 
-    void update_texture(workspace_name& wsn)
-    {
-        update_texture_position(wsn);
-        render_workspace_name(wsn);
+        output->render->damage_whole();
     }
 
-    void update_textures()
+    void update_label(wf::point_t ws)
     {
-        auto wsize = output->workspace->get_workspace_grid_size();
-        for (int x = 0; x < wsize.width; x++)
+        auto& wsn = workspaces[ws.x][ws.y];
+        if (!wsn.stale)
         {
-            for (int y = 0; y < wsize.height; y++)
-            {
-                update_texture(workspaces[x][y]);
-            }
+            return;
         }
-        output->render->damage_whole();
+
+        update_name(ws.x, ws.y);
+        update_texture_position(wsn);
+        render_workspace_name(wsn);
+        wsn.stale = false;
     }
 
-    void cairo_recreate(workspace_name& wsn)
+    void set_font(cairo_t *cr)
     {
         auto og = output->get_relative_geometry();
         auto font_size = og.height * 0.05;
-        cairo_t *cr = wsn.cr;
-        cairo_surface_t *cairo_surface = wsn.cairo_surface;
 
-        if (!cr)
+        cairo_select_font_face(cr, std::string(font).c_str(), CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
+        cairo_set_font_size(cr, font_size);
+    }
+
+    void measure_label(workspace_name& wsn)
+    {
+        cairo_text_extents_t text_extents;
+
+        if (!measure_cr)
         {
-            /* Setup dummy context to get initial font size */
-            cairo_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
-            cr = cairo_create(cairo_surface);
-            wsn.texture = std::make_unique<wf::simple_texture_t> ();
+            measure_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 1, 1);
+            measure_cr = cairo_create(measure_surface);
         }
 
-        cairo_select_font_face(cr, std::string(font).c_str(), CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-        cairo_set_font_size(cr, font_size);
+        set_font(measure_cr);
+        cairo_text_extents(measure_cr, wsn.name.c_str(), &text_extents);
 
-        const char *name = wsn.name.c_str();
-        cairo_text_extents(cr, name, &wsn.text_extents);
+        wsn.rect.width = text_extents.width + WIDGET_PADDING * 2;
+        wsn.rect.height = text_extents.height + WIDGET_PADDING * 2;
+    }
 
-        wsn.rect.width = wsn.text_extents.width + WIDGET_PADDING * 2;
-        wsn.rect.height = wsn.text_extents.height + WIDGET_PADDING * 2;
+    /*
+     * A label keeps its slot if it still fits, otherwise it gets a new
+     * one. When the atlas is full it is emptied and grown, and the other
+     * labels are packed again as they are shown. Once it can't grow any
+     * more it is only emptied, labels that are not shown right now are
+     * what fills it up.
+     */
+    bool place_label(workspace_name& wsn, int w, int h)
+    {
+        if ((wsn.slot.width >= w) && (wsn.slot.height >= h))
+        {
+            wsn.slot.width  = w;
+            wsn.slot.height = h;
+            return true;
+        }
 
-        /* Recreate surface based on font size */
-        cairo_destroy(cr);
-        cairo_surface_destroy(cairo_surface);
+        GLint max_size;
+        GL_CALL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size));
+        if (!atlas.tex)
+        {
+            auto og = output->get_relative_geometry();
+            atlas.resize(std::min(std::max(og.width, w), (int)max_size),
+                std::min(h * 4, (int)max_size));
+        }
 
-        cairo_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, wsn.rect.width, wsn.rect.height);
-        cr = cairo_create(cairo_surface);
+        wsn.slot = {0, 0, 0, 0};
+        while (!atlas.allocate(w, h, wsn.slot))
+        {
+            int width  = std::min(std::max(atlas.width, w), (int)max_size);
+            int height = std::min(atlas.height * 2, (int)max_size);
+            bool grow = (width != atlas.width) || (height != atlas.height);
+            if (!grow && atlas.empty())
+            {
+                return false;
+            }
 
-        cairo_select_font_face(cr, std::string(font).c_str(), CAIRO_FONT_SLANT_NORMAL, CAIRO_FONT_WEIGHT_NORMAL);
-        cairo_set_font_size(cr, font_size);
+            for (auto& column : workspaces)
+            {
+                for (auto& other : column)
+                {
+                    other.slot  = {0, 0, 0, 0};
+                    other.stale = true;
+                }
+            }
+
+            if (grow)
+            {
+                atlas.resize(width, height);
+            } else
+            {
+                atlas.clear();
+            }
+        }
 
-        wsn.cr = cr;
-        wsn.cairo_surface = cairo_surface;
+        return true;
     }
 
     wf::config::option_base_t::updated_callback_t option_changed = [=] ()
     {
-        update_textures();
+        invalidate_labels();
     };
 
     void update_texture_position(workspace_name& wsn)
     {
         auto workarea = output->workspace->get_workarea();
 
-        cairo_recreate(wsn);
+        measure_label(wsn);
 
         if ((std::string) position == "top_left")
         {
@@ -289,16 +493,9 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
 
     wf::signal_connection_t workarea_changed{[this] (wf::signal_data_t *data)
     {
-        update_textures();
+        invalidate_labels();
     }};
 
-    void cairo_clear(cairo_t *cr)
-    {
-        cairo_set_source_rgba(cr, 0, 0, 0, 0);
-        cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
-        cairo_paint(cr);
-    }
-
     /* GLESv2 doesn't support GL_BGRA */
     void cairo_set_source_rgba_swizzle(cairo_t *cr, double r, double g, double b, double a)
     {
@@ -312,9 +509,16 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
         int x2, y2;
         const char *name = wsn.name.c_str();
         double radius = 30;
-        cairo_t *cr = wsn.cr;
+        cairo_text_extents_t text_extents;
 
-        cairo_clear(cr);
+        /* The label is drawn into a temporary surface and copied into
+         * the atlas, the margin stays transparent */
+        int w = wsn.rect.width + ATLAS_MARGIN * 2;
+        int h = wsn.rect.height + ATLAS_MARGIN * 2;
+        cairo_surface_t *cairo_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
+        cairo_t *cr = cairo_create(cairo_surface);
+        cairo_translate(cr, ATLAS_MARGIN, ATLAS_MARGIN);
+        set_font(cr);
 
         x2 = wsn.rect.width;
         y2 = wsn.rect.height;
@@ -340,28 +544,57 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
             wf::color_t(text_color).g,
             wf::color_t(text_color).b,
             wf::color_t(text_color).a);
-        cairo_text_extents(cr, name, &wsn.text_extents);
+        cairo_text_extents(cr, name, &text_extents);
         cairo_move_to(cr,
-            xc - (wsn.text_extents.width / 2 + wsn.text_extents.x_bearing),
-            yc - (wsn.text_extents.height / 2 + wsn.text_extents.y_bearing));
+            xc - (text_extents.width / 2 + text_extents.x_bearing),
+            yc - (text_extents.height / 2 + text_extents.y_bearing));
         cairo_show_text(cr, name);
         cairo_stroke(cr);
 
         OpenGL::render_begin();
-        cairo_surface_upload_to_texture(wsn.cairo_surface, *wsn.texture);
+        if (place_label(wsn, w, h))
+        {
+            atlas.upload(cairo_surface, wsn.slot);
+        }
         OpenGL::render_end();
+
+        cairo_destroy(cr);
+        cairo_surface_destroy(cairo_surface);
+    }
+
+    /* Damage the label of every workspace that has one, where it
+     * appears in its workspace stream */
+    void damage_labels()
+    {
+        auto wsize = output->workspace->get_workspace_grid_size();
+        for (int x = 0; x < wsize.width; x++)
+        {
+            for (int y = 0; y < wsize.height; y++)
+            {
+                auto& wsn = workspaces[x][y];
+                if (wsn.rect.width <= 0)
+                {
+                    continue;
+                }
+
+                auto box = output->render->get_ws_box({x, y});
+                output->render->damage({box.x + wsn.rect.x, box.y + wsn.rect.y,
+                    wsn.rect.width, wsn.rect.height});
+            }
+        }
     }
 
     wf::effect_hook_t pre_hook = [=] ()
     {
         if (alpha_fade.running())
         {
-            output->render->damage_whole();
+            damage_labels();
         }
     };
 
     wf::signal_connection_t viewport_changed{[this] (wf::signal_data_t *data)
     {
+        update_label(output->workspace->get_current_workspace());
         activate();
 
         if (!alpha_fade.running())
@@ -386,7 +619,7 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
 
     wf::wl_timer::callback_t timeout = [=] ()
     {
-        output->render->damage_whole();
+        damage_labels();
         alpha_fade.animate(1.0, 0.0);
         timer.disconnect();
         timed_out = true;
@@ -396,6 +629,13 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
     {
         const auto& workspace = static_cast<wf::stream_signal_t*>(data);
         auto& wsn = workspaces[workspace->ws.x][workspace->ws.y];
+
+        update_label(workspace->ws);
+        if (wsn.slot.width <= 0)
+        {
+            return;
+        }
+
         auto damage = output->render->get_scheduled_damage() &
             output->render->get_ws_box(workspace->ws);
         auto og = workspace->fb.geometry;
@@ -408,7 +648,7 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
         for (auto& box : damage)
         {
             workspace->fb.logic_scissor(wlr_box_from_pixman_box(box));
-            OpenGL::render_texture(wf::texture_t{wsn.texture->tex},
+            OpenGL::render_texture(atlas.texture(wsn.slot),
                 workspace->fb, rect, glm::vec4(1, 1, 1, alpha_fade),
                 OpenGL::TEXTURE_TRANSFORM_INVERT_Y);
         }
@@ -423,7 +663,7 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
             {
                 deactivate();
                 timed_out = false;
-                output->render->damage_whole();
+                damage_labels();
             }
             else if (!timer.is_connected())
             {
@@ -458,18 +698,16 @@ class wayfire_workspace_names_screen : public wf::plugin_interface_t
     void fini() override
     {
         deactivate();
-        auto wsize = output->workspace->get_workspace_grid_size();
-        for (int x = 0; x < wsize.width; x++)
+        reload_config.disconnect();
+        if (measure_cr)
         {
-            for (int y = 0; y < wsize.height; y++)
-            {
-                auto& wsn = workspaces[x][y];
-                cairo_surface_destroy(wsn.cairo_surface);
-                cairo_destroy(wsn.cr);
-                wsn.texture->release();
-                wsn.texture.reset();
-            }
+            cairo_destroy(measure_cr);
+            cairo_surface_destroy(measure_surface);
         }
+
+        OpenGL::render_begin();
+        atlas.release();
+        OpenGL::render_end();
         output->render->damage_whole();
     }
 };